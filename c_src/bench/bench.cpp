@@ -0,0 +1,302 @@
+// Standalone microbenchmark for the native parts of esimdjson.
+//
+// Times simdjson's stage 1 (structural indexing), stage 2 (tape construction),
+// make_term_from_dom and estimate_term_words separately for every document of
+// a corpus, without the scheduler noise of running inside the VM. Terms are
+// built against the arena in enif_stub.cpp.
+//
+// With -m load_batch, instead times loading the whole corpus with one call of
+// the load_batch NIF against loading it file by file, as load/2 does. Run it
+// with -n 1 after dropping the page cache to compare cold starts.
+//
+// Usage: esimdjson_bench [-n ITERATIONS] [-o map|proplist|tuple_list]
+//                        [-m parse|load_batch] FILE...
+
+#include "../decode.h"
+#include "enif_stub.h"
+#include "simdjson.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+extern "C" ErlNifEntry *nif_init(void);
+
+#define NUM_COUNTERS 3
+
+enum phase { STAGE1, STAGE2, MAKE_TERM, ESTIMATE, NUM_PHASES };
+
+static const char *phase_names[NUM_PHASES] = {"stage1", "stage2", "make_term",
+                                              "estimate"};
+
+/// Hardware counters for the calling thread. Opening the counters fails
+/// harmlessly when perf_event is unavailable or restricted by
+/// perf_event_paranoid, in which case only wall-clock times are reported.
+struct perf_counters {
+  int group_fd = -1;
+
+  bool open() {
+#ifdef __linux__
+    const uint64_t configs[NUM_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES,
+                                            PERF_COUNT_HW_INSTRUCTIONS,
+                                            PERF_COUNT_HW_BRANCH_MISSES};
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = configs[i];
+      attr.disabled = i == 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+      int fd = syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+      if (fd < 0) {
+        close();
+        return false;
+      }
+      if (i == 0)
+        group_fd = fd;
+    }
+    ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void close() {
+#ifdef __linux__
+    // Closing the leader tears down the whole group.
+    if (group_fd >= 0)
+      ::close(group_fd);
+#endif
+    group_fd = -1;
+  }
+
+  bool read(uint64_t values[NUM_COUNTERS]) const {
+#ifdef __linux__
+    uint64_t buf[1 + NUM_COUNTERS];
+    if (group_fd < 0 || ::read(group_fd, buf, sizeof(buf)) != sizeof(buf))
+      return false;
+    std::copy(buf + 1, buf + 1 + NUM_COUNTERS, values);
+    return true;
+#else
+    return false;
+#endif
+  }
+};
+
+struct phase_stats {
+  uint64_t best_ns = UINT64_MAX;
+  uint64_t total_ns = 0;
+  uint64_t counters[NUM_COUNTERS] = {0};
+};
+
+/// Runs `fun` and accumulates its elapsed time and counter deltas into `stats`.
+template <typename F>
+static void measure(const perf_counters &perf, phase_stats &stats, F fun) {
+  uint64_t before[NUM_COUNTERS], after[NUM_COUNTERS];
+  bool have_counters = perf.read(before);
+  auto start = std::chrono::steady_clock::now();
+  fun();
+  auto end = std::chrono::steady_clock::now();
+  if (have_counters && perf.read(after))
+    for (int i = 0; i < NUM_COUNTERS; i++)
+      stats.counters[i] += after[i] - before[i];
+
+  uint64_t ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+          .count();
+  stats.best_ns = std::min(stats.best_ns, ns);
+  stats.total_ns += ns;
+}
+
+static void check(simdjson::error_code error, const char *path) {
+  if (error) {
+    std::fprintf(stderr, "%s: %s\n", path, simdjson::error_message(error));
+    std::exit(1);
+  }
+}
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+static void bench_load_batch(char **paths, int count, size_t iterations,
+                             const ErlNifEntry *entry, ErlNifEnv *env) {
+  const ErlNifFunc *load_batch = nullptr;
+  for (int i = 0; i < entry->num_of_funcs; i++)
+    if (std::strcmp(entry->funcs[i].name, "load_batch") == 0)
+      load_batch = &entry->funcs[i];
+
+  uint64_t sequential_ns = UINT64_MAX, batch_ns = UINT64_MAX;
+  for (size_t i = 0; i < iterations; i++) {
+    // One parser reused for every file, as with load/2.
+    stub_env_reset(env);
+    auto start = std::chrono::steady_clock::now();
+    simdjson::dom::parser parser;
+    for (int f = 0; f < count; f++) {
+      simdjson::dom::element element;
+      check(parser.load(paths[f]).get(element), paths[f]);
+      ERL_NIF_TERM term;
+      make_term_from_dom(env, element, &term);
+    }
+    sequential_ns = std::min(sequential_ns, elapsed_ns(start));
+
+    stub_env_reset(env);
+    start = std::chrono::steady_clock::now();
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for (int f = count; f > 0; f--)
+      list = enif_make_list_cell(
+          env, enif_make_string(env, paths[f - 1], ERL_NIF_LATIN1), list);
+    ERL_NIF_TERM argv[2] = {list, enif_make_list(env, 0)};
+    load_batch->fptr(env, 2, argv);
+    batch_ns = std::min(batch_ns, elapsed_ns(start));
+  }
+
+  std::printf("%d files\n", count);
+  std::printf("  sequential best %12llu ns\n",
+              (unsigned long long)sequential_ns);
+  std::printf("  load_batch best %12llu ns  %5.2fx\n",
+              (unsigned long long)batch_ns, double(sequential_ns) / batch_ns);
+}
+
+static void bench_file(const char *path, size_t iterations,
+                       object_format objects, ErlNifEnv *env,
+                       const perf_counters &perf, bool have_counters) {
+  simdjson::padded_string json;
+  check(simdjson::padded_string::load(path).get(json), path);
+
+  simdjson::dom::parser parser;
+  check(parser.allocate(json.size()), path);
+
+  phase_stats stats[NUM_PHASES];
+  const uint8_t *buf = (const uint8_t *)json.data();
+  size_t words = 0;
+  size_t estimated_words = 0;
+
+  for (size_t i = 0; i < iterations; i++) {
+    simdjson::error_code error;
+    measure(perf, stats[STAGE1], [&] {
+      error = parser.implementation->stage1(buf, json.size(), false);
+    });
+    check(error, path);
+    measure(perf, stats[STAGE2],
+            [&] { error = parser.implementation->stage2(parser.doc); });
+    check(error, path);
+
+    stub_env_reset(env);
+    ERL_NIF_TERM term;
+    measure(perf, stats[MAKE_TERM], [&] {
+      term_context ctx;
+      ctx.options.objects = objects;
+      make_term_from_dom(env, parser.doc.root(), &term, ctx);
+    });
+    words = stub_env_words(env);
+
+    measure(perf, stats[ESTIMATE], [&] {
+      term_context ctx;
+      ctx.options.objects = objects;
+      estimated_words = estimate_term_words(parser.doc, ctx);
+    });
+  }
+
+  // The arena does not size terms exactly as erts does, which the estimate
+  // follows, so the two only roughly agree.
+  std::printf("%s: %zu bytes, %zu heap words, %zu estimated\n", path,
+              json.size(), words, estimated_words);
+  for (int p = 0; p < NUM_PHASES; p++) {
+    const phase_stats &s = stats[p];
+    double mean_ns = double(s.total_ns) / iterations;
+    std::printf("  %-10s best %10llu ns  mean %12.0f ns  %8.1f MB/s",
+                phase_names[p], (unsigned long long)s.best_ns, mean_ns,
+                json.size() * 1e3 / s.best_ns);
+    if (have_counters) {
+      double cycles = double(s.counters[0]) / iterations;
+      double instructions = double(s.counters[1]) / iterations;
+      double misses = double(s.counters[2]) / iterations;
+      std::printf("  %6.2f cycles/byte  %5.2f IPC  %10.0f branch misses",
+                  cycles / json.size(), cycles ? instructions / cycles : 0.0,
+                  misses);
+    }
+    std::printf("\n");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t iterations = 100;
+  object_format objects = OBJECTS_MAP;
+  bool load_batch = false;
+  bool usage = false;
+  int argi = 1;
+  for (; argi + 1 < argc && argv[argi][0] == '-'; argi += 2) {
+    if (std::strcmp(argv[argi], "-n") == 0)
+      iterations = std::strtoul(argv[argi + 1], nullptr, 10);
+    else if (std::strcmp(argv[argi], "-o") == 0 &&
+             std::strcmp(argv[argi + 1], "map") == 0)
+      objects = OBJECTS_MAP;
+    else if (std::strcmp(argv[argi], "-o") == 0 &&
+             std::strcmp(argv[argi + 1], "proplist") == 0)
+      objects = OBJECTS_PROPLIST;
+    else if (std::strcmp(argv[argi], "-o") == 0 &&
+             std::strcmp(argv[argi + 1], "tuple_list") == 0)
+      objects = OBJECTS_TUPLE_LIST;
+    else if (std::strcmp(argv[argi], "-m") == 0 &&
+             std::strcmp(argv[argi + 1], "parse") == 0)
+      load_batch = false;
+    else if (std::strcmp(argv[argi], "-m") == 0 &&
+             std::strcmp(argv[argi + 1], "load_batch") == 0)
+      load_batch = true;
+    else
+      usage = true;
+  }
+  if (usage || argi >= argc || iterations == 0) {
+    std::fprintf(stderr,
+                 "usage: %s [-n ITERATIONS] [-o map|proplist|tuple_list] "
+                 "[-m parse|load_batch] FILE...\n",
+                 argv[0]);
+    return 2;
+  }
+
+  // Run the NIF load callback so that the atoms and the resource type are
+  // initialised exactly as they would be in the VM.
+  ErlNifEntry *entry = nif_init();
+  void *priv_data = nullptr;
+  ErlNifEnv *env = stub_env_new(nullptr);
+  if (entry->load(env, &priv_data, enif_make_list(env, 0)) != 0) {
+    std::fprintf(stderr, "NIF load callback failed\n");
+    return 1;
+  }
+  stub_env_free(env);
+  env = stub_env_new(priv_data);
+
+  perf_counters perf;
+  bool have_counters = perf.open();
+  std::printf("implementation: %s, iterations: %zu, perf counters: %s\n",
+              simdjson::active_implementation->name().c_str(), iterations,
+              have_counters ? "yes" : "unavailable");
+
+  if (load_batch)
+    bench_load_batch(argv + argi, argc - argi, iterations, entry, env);
+  else
+    for (; argi < argc; argi++)
+      bench_file(argv[argi], iterations, objects, env, perf, have_counters);
+
+  perf.close();
+  stub_env_free(env);
+  // Stops the threads started by the load callback.
+  entry->unload(nullptr, priv_data);
+  return 0;
+}
@@ -0,0 +1,538 @@
+// Minimal stand-in for the parts of the erl_nif API used by esimdjson.cpp, so
+// that the term builder can be linked into a standalone executable and timed
+// without a running VM.
+//
+// Term construction functions allocate from a bump arena attached to the
+// environment, which roughly mirrors the cost profile of building terms on a
+// process heap. Functions which are only reachable through the NIF entry
+// points (argument decoding, resources, ...) abort if they are ever called.
+
+#include "enif_stub.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// The int64 functions are macros for their long counterparts on LP64
+// platforms, so they are defined through their portable names below.
+
+// Terms are either 8-byte aligned pointers into the arena or tagged
+// immediates, using the low 3 bits as the tag. List cells are pointers tagged
+// with TAG_LIST, other boxed terms start with a size word.
+#define TAG_BOXED 0x0
+#define TAG_SMALL 0x1
+#define TAG_ATOM 0x2
+#define TAG_NIL 0x3
+#define TAG_BADARG 0x4
+#define TAG_LIST 0x5
+#define TAG_MASK 0x7
+
+#define SMALL_BITS 60
+
+/// Largest map erts builds as a flatmap
+#define MAP_SMALL_MAP_LIMIT 32
+
+struct enif_environment_t {
+  std::vector<std::unique_ptr<uint64_t[]>> blocks;
+  uint64_t *top = nullptr;
+  uint64_t *end = nullptr;
+  size_t words = 0;
+  void *priv_data = nullptr;
+};
+
+struct enif_resource_type_t {
+  ErlNifResourceDtor *dtor;
+};
+
+// Thread primitives used by the background threads and the document store
+// map onto pthreads.
+struct ErlDrvMutex_ {
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+};
+
+struct ErlDrvCond_ {
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+};
+
+struct ErlDrvRWLock_ {
+  pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+};
+
+struct ErlDrvTid_ {
+  pthread_t thread;
+};
+
+namespace {
+
+const size_t block_words = 1 << 16;
+
+std::unordered_map<std::string, ERL_NIF_TERM> atom_table;
+
+uint64_t *heap_alloc(ErlNifEnv *env, size_t words) {
+  if (env->top + words > env->end) {
+    size_t n = words > block_words ? words : block_words;
+    env->blocks.emplace_back(new uint64_t[n]);
+    env->top = env->blocks.back().get();
+    env->end = env->top + n;
+  }
+  uint64_t *p = env->top;
+  env->top += words;
+  env->words += words;
+  return p;
+}
+
+ERL_NIF_TERM boxed(uint64_t *p) { return ERL_NIF_TERM(p) | TAG_BOXED; }
+
+const char *binary_data(ERL_NIF_TERM term, size_t *size) {
+  const uint64_t *p = (const uint64_t *)term;
+  *size = p[0];
+  return (const char *)(p + 1);
+}
+
+int binary_compare(ERL_NIF_TERM a, ERL_NIF_TERM b) {
+  size_t a_size, b_size;
+  const char *a_data = binary_data(a, &a_size);
+  const char *b_data = binary_data(b, &b_size);
+  int cmp = std::memcmp(a_data, b_data, std::min(a_size, b_size));
+  if (cmp)
+    return cmp;
+  return a_size < b_size ? -1 : a_size > b_size;
+}
+
+uint64_t binary_hash(ERL_NIF_TERM term) {
+  size_t size;
+  const char *data = binary_data(term, &size);
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+  return hash;
+}
+
+[[noreturn]] void unsupported(const char *fun) {
+  std::fprintf(stderr, "enif_stub: %s is not supported outside the VM\n", fun);
+  std::abort();
+}
+
+} // namespace
+
+ErlNifEnv *stub_env_new(void *priv_data) {
+  ErlNifEnv *env = new ErlNifEnv;
+  env->priv_data = priv_data;
+  return env;
+}
+
+void stub_env_reset(ErlNifEnv *env) {
+  // Keep the first block around, like a process heap after a GC.
+  if (env->blocks.size() > 1)
+    env->blocks.resize(1);
+  env->top = env->blocks.empty() ? nullptr : env->blocks[0].get();
+  env->end = env->top ? env->top + block_words : nullptr;
+  env->words = 0;
+}
+
+void stub_env_free(ErlNifEnv *env) { delete env; }
+
+size_t stub_env_words(const ErlNifEnv *env) { return env->words; }
+
+extern "C" {
+
+void *enif_priv_data(ErlNifEnv *env) { return env->priv_data; }
+
+void *enif_alloc(size_t size) { return std::malloc(size); }
+
+void enif_free(void *ptr) { std::free(ptr); }
+
+ErlNifResourceType *enif_open_resource_type(ErlNifEnv *, const char *,
+                                            const char *,
+                                            ErlNifResourceDtor *dtor,
+                                            ErlNifResourceFlags,
+                                            ErlNifResourceFlags *) {
+  return new ErlNifResourceType{dtor};
+}
+
+ErlNifResourceType *enif_open_resource_type_x(ErlNifEnv *, const char *,
+                                              const ErlNifResourceTypeInit *init,
+                                              ErlNifResourceFlags,
+                                              ErlNifResourceFlags *) {
+  return new ErlNifResourceType{init->dtor};
+}
+
+ErlNifMutex *enif_mutex_create(char *) { return new ErlNifMutex; }
+
+void enif_mutex_destroy(ErlNifMutex *mtx) {
+  pthread_mutex_destroy(&mtx->mutex);
+  delete mtx;
+}
+
+void enif_mutex_lock(ErlNifMutex *mtx) { pthread_mutex_lock(&mtx->mutex); }
+
+void enif_mutex_unlock(ErlNifMutex *mtx) { pthread_mutex_unlock(&mtx->mutex); }
+
+ErlNifRWLock *enif_rwlock_create(char *) { return new ErlNifRWLock; }
+
+void enif_rwlock_destroy(ErlNifRWLock *rwlck) {
+  pthread_rwlock_destroy(&rwlck->rwlock);
+  delete rwlck;
+}
+
+void enif_rwlock_rlock(ErlNifRWLock *rwlck) {
+  pthread_rwlock_rdlock(&rwlck->rwlock);
+}
+
+void enif_rwlock_runlock(ErlNifRWLock *rwlck) {
+  pthread_rwlock_unlock(&rwlck->rwlock);
+}
+
+void enif_rwlock_rwlock(ErlNifRWLock *rwlck) {
+  pthread_rwlock_wrlock(&rwlck->rwlock);
+}
+
+void enif_rwlock_rwunlock(ErlNifRWLock *rwlck) {
+  pthread_rwlock_unlock(&rwlck->rwlock);
+}
+
+ErlNifCond *enif_cond_create(char *) { return new ErlNifCond; }
+
+void enif_cond_destroy(ErlNifCond *cnd) {
+  pthread_cond_destroy(&cnd->cond);
+  delete cnd;
+}
+
+void enif_cond_signal(ErlNifCond *cnd) { pthread_cond_signal(&cnd->cond); }
+
+void enif_cond_broadcast(ErlNifCond *cnd) {
+  pthread_cond_broadcast(&cnd->cond);
+}
+
+void enif_cond_wait(ErlNifCond *cnd, ErlNifMutex *mtx) {
+  pthread_cond_wait(&cnd->cond, &mtx->mutex);
+}
+
+int enif_thread_create(char *, ErlNifTid *tid, void *(*func)(void *),
+                       void *args, ErlNifThreadOpts *) {
+  *tid = new ErlDrvTid_;
+  int ret = pthread_create(&(*tid)->thread, nullptr, func, args);
+  if (ret) {
+    delete *tid;
+    *tid = nullptr;
+  }
+  return ret;
+}
+
+int enif_thread_join(ErlNifTid tid, void **respp) {
+  int ret = pthread_join(tid->thread, respp);
+  delete tid;
+  return ret;
+}
+
+ERL_NIF_TERM enif_make_atom(ErlNifEnv *, const char *name) {
+  auto it = atom_table.find(name);
+  if (it != atom_table.end())
+    return it->second;
+  ERL_NIF_TERM atom = (ERL_NIF_TERM(atom_table.size()) << 3) | TAG_ATOM;
+  atom_table.emplace(name, atom);
+  return atom;
+}
+
+int enif_make_existing_atom(ErlNifEnv *, const char *name, ERL_NIF_TERM *atom,
+                            ErlNifCharEncoding) {
+  auto it = atom_table.find(name);
+  if (it == atom_table.end())
+    return 0;
+  *atom = it->second;
+  return 1;
+}
+
+int enif_get_atom(ErlNifEnv *, ERL_NIF_TERM atom, char *buf, unsigned len,
+                  ErlNifCharEncoding) {
+  // Returns the length with the terminating null, as erts does.
+  for (const auto &entry : atom_table)
+    if (entry.second == atom && entry.first.size() < len) {
+      std::memcpy(buf, entry.first.c_str(), entry.first.size() + 1);
+      return entry.first.size() + 1;
+    }
+  return 0;
+}
+
+ERL_NIF_TERM enif_make_badarg(ErlNifEnv *) { return TAG_BADARG; }
+
+ERL_NIF_TERM enif_make_tuple(ErlNifEnv *env, unsigned cnt, ...) {
+  uint64_t *p = heap_alloc(env, 1 + cnt);
+  p[0] = cnt;
+  va_list ap;
+  va_start(ap, cnt);
+  for (unsigned i = 0; i < cnt; i++)
+    p[1 + i] = va_arg(ap, ERL_NIF_TERM);
+  va_end(ap);
+  return boxed(p);
+}
+
+ERL_NIF_TERM enif_make_list(ErlNifEnv *env, unsigned cnt, ...) {
+  std::vector<ERL_NIF_TERM> arr(cnt);
+  va_list ap;
+  va_start(ap, cnt);
+  for (unsigned i = 0; i < cnt; i++)
+    arr[i] = va_arg(ap, ERL_NIF_TERM);
+  va_end(ap);
+
+  ERL_NIF_TERM list = TAG_NIL;
+  for (unsigned i = cnt; i > 0; i--)
+    list = enif_make_list_cell(env, arr[i - 1], list);
+  return list;
+}
+
+ERL_NIF_TERM enif_make_list_from_array(ErlNifEnv *env, const ERL_NIF_TERM arr[],
+                                       unsigned cnt) {
+  ERL_NIF_TERM list = TAG_NIL;
+  for (unsigned i = cnt; i > 0; i--)
+    list = enif_make_list_cell(env, arr[i - 1], list);
+  return list;
+}
+
+ERL_NIF_TERM enif_make_list_cell(ErlNifEnv *env, ERL_NIF_TERM car,
+                                 ERL_NIF_TERM cdr) {
+  uint64_t *p = heap_alloc(env, 2);
+  p[0] = car;
+  p[1] = cdr;
+  return ERL_NIF_TERM(p) | TAG_LIST;
+}
+
+int enif_is_list(ErlNifEnv *, ERL_NIF_TERM term) {
+  return term == TAG_NIL || (term & TAG_MASK) == TAG_LIST;
+}
+
+int enif_get_list_cell(ErlNifEnv *, ERL_NIF_TERM term, ERL_NIF_TERM *head,
+                       ERL_NIF_TERM *tail) {
+  if ((term & TAG_MASK) != TAG_LIST)
+    return 0;
+  const uint64_t *p = (const uint64_t *)(term & ~ERL_NIF_TERM(TAG_MASK));
+  *head = p[0];
+  *tail = p[1];
+  return 1;
+}
+
+ERL_NIF_TERM enif_make_string(ErlNifEnv *env, const char *string,
+                              ErlNifCharEncoding) {
+  ERL_NIF_TERM list = TAG_NIL;
+  for (size_t i = std::strlen(string); i > 0; i--)
+    list = enif_make_list_cell(
+        env, (ERL_NIF_TERM((unsigned char)string[i - 1]) << 3) | TAG_SMALL,
+        list);
+  return list;
+}
+
+unsigned char *enif_make_new_binary(ErlNifEnv *env, size_t size,
+                                    ERL_NIF_TERM *termp) {
+  // Header word plus the payload, as for a heap binary.
+  uint64_t *p = heap_alloc(env, 1 + (size + 7) / 8);
+  p[0] = size;
+  *termp = boxed(p);
+  return (unsigned char *)(p + 1);
+}
+
+ERL_NIF_TERM enif_make_int64(ErlNifEnv *env, ErlNifSInt64 i) {
+  const ErlNifSInt64 small_max = ErlNifSInt64(1) << (SMALL_BITS - 1);
+  if (i >= -small_max && i < small_max)
+    return (ERL_NIF_TERM(i) << 3) | TAG_SMALL;
+  uint64_t *p = heap_alloc(env, 2);
+  p[0] = 1;
+  p[1] = uint64_t(i);
+  return boxed(p);
+}
+
+ERL_NIF_TERM enif_make_uint64(ErlNifEnv *env, ErlNifUInt64 i) {
+  const ErlNifUInt64 small_max = ErlNifUInt64(1) << (SMALL_BITS - 1);
+  if (i < small_max)
+    return (ERL_NIF_TERM(i) << 3) | TAG_SMALL;
+  uint64_t *p = heap_alloc(env, 2);
+  p[0] = 1;
+  p[1] = i;
+  return boxed(p);
+}
+
+ERL_NIF_TERM enif_make_double(ErlNifEnv *env, double d) {
+  uint64_t *p = heap_alloc(env, 2);
+  p[0] = 0;
+  std::memcpy(p + 1, &d, sizeof(d));
+  return boxed(p);
+}
+
+int enif_make_map_from_arrays(ErlNifEnv *env, ERL_NIF_TERM keys[],
+                              ERL_NIF_TERM values[], size_t cnt,
+                              ERL_NIF_TERM *map_out) {
+  // Like erts, keys are sorted so that duplicates can be rejected: by term
+  // order for flatmaps of up to 32 keys, and by hash for larger hashmaps.
+  // Keys are assumed to be binaries, the only keys JSON objects can have.
+  bool hashmap = cnt > MAP_SMALL_MAP_LIMIT;
+  std::vector<size_t> order(cnt);
+  for (size_t i = 0; i < cnt; i++)
+    order[i] = i;
+  std::vector<uint64_t> hashes(hashmap ? cnt : 0);
+  for (size_t i = 0; i < hashes.size(); i++)
+    hashes[i] = binary_hash(keys[i]);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (hashmap && hashes[a] != hashes[b])
+      return hashes[a] < hashes[b];
+    return binary_compare(keys[a], keys[b]) < 0;
+  });
+  for (size_t i = 1; i < cnt; i++)
+    if (binary_compare(keys[order[i - 1]], keys[order[i]]) == 0)
+      return 0;
+
+  // Flatmaps are a header, a key tuple and the values. Hashmap nodes are
+  // approximated as one extra word per pair.
+  size_t words = 2 + 2 * cnt + (hashmap ? cnt : 1);
+  uint64_t *p = heap_alloc(env, words);
+  p[0] = cnt;
+  for (size_t i = 0; i < cnt; i++) {
+    p[1 + i] = keys[order[i]];
+    p[1 + cnt + i] = values[order[i]];
+  }
+  *map_out = boxed(p);
+  return 1;
+}
+
+ERL_NIF_TERM enif_make_resource(ErlNifEnv *, void *) {
+  unsupported("enif_make_resource");
+}
+
+void *enif_alloc_resource(ErlNifResourceType *, size_t) {
+  unsupported("enif_alloc_resource");
+}
+
+void enif_release_resource(void *) { unsupported("enif_release_resource"); }
+
+int enif_get_resource(ErlNifEnv *, ERL_NIF_TERM, ErlNifResourceType *,
+                      void **) {
+  unsupported("enif_get_resource");
+}
+
+ERL_NIF_TERM enif_make_new_map(ErlNifEnv *) {
+  unsupported("enif_make_new_map");
+}
+
+int enif_make_map_put(ErlNifEnv *, ERL_NIF_TERM, ERL_NIF_TERM, ERL_NIF_TERM,
+                      ERL_NIF_TERM *) {
+  unsupported("enif_make_map_put");
+}
+
+// Lists and strings are decoded for the NIFs called by the benchmark itself,
+// such as load_batch.
+int enif_get_list_length(ErlNifEnv *env, ERL_NIF_TERM term, unsigned *len) {
+  ERL_NIF_TERM head;
+  *len = 0;
+  while (enif_get_list_cell(env, term, &head, &term))
+    (*len)++;
+  return term == TAG_NIL;
+}
+
+int enif_get_string(ErlNifEnv *env, ERL_NIF_TERM list, char *buf, unsigned len,
+                    ErlNifCharEncoding) {
+  ERL_NIF_TERM head;
+  unsigned i = 0;
+  for (; enif_get_list_cell(env, list, &head, &list); i++) {
+    if ((head & TAG_MASK) != TAG_SMALL || i + 1 >= len)
+      return 0;
+    buf[i] = char(head >> 3);
+  }
+  if (list != TAG_NIL || len == 0)
+    return 0;
+  buf[i] = '\0';
+  return i + 1;
+}
+
+int enif_get_tuple(ErlNifEnv *, ERL_NIF_TERM, int *, const ERL_NIF_TERM **) {
+  unsupported("enif_get_tuple");
+}
+
+int enif_is_identical(ERL_NIF_TERM, ERL_NIF_TERM) {
+  unsupported("enif_is_identical");
+}
+
+int enif_get_uint64(ErlNifEnv *, ERL_NIF_TERM, ErlNifUInt64 *) {
+  unsupported("enif_get_uint64");
+}
+
+int enif_inspect_binary(ErlNifEnv *, ERL_NIF_TERM, ErlNifBinary *) {
+  unsupported("enif_inspect_binary");
+}
+
+size_t enif_binary_to_term(ErlNifEnv *, const unsigned char *, size_t,
+                           ERL_NIF_TERM *, ErlNifBinaryToTerm) {
+  unsupported("enif_binary_to_term");
+}
+
+int enif_is_atom(ErlNifEnv *, ERL_NIF_TERM term) {
+  return (term & 7) == TAG_ATOM;
+}
+
+ERL_NIF_TERM enif_make_copy(ErlNifEnv *, ERL_NIF_TERM) {
+  unsupported("enif_make_copy");
+}
+
+ErlNifEnv *enif_alloc_env() { unsupported("enif_alloc_env"); }
+
+void enif_free_env(ErlNifEnv *) { unsupported("enif_free_env"); }
+
+int enif_is_empty_list(ErlNifEnv *, ERL_NIF_TERM) {
+  unsupported("enif_is_empty_list");
+}
+
+int enif_make_reverse_list(ErlNifEnv *, ERL_NIF_TERM, ERL_NIF_TERM *) {
+  unsupported("enif_make_reverse_list");
+}
+
+int enif_consume_timeslice(ErlNifEnv *, int) {
+  unsupported("enif_consume_timeslice");
+}
+
+ERL_NIF_TERM enif_schedule_nif(ErlNifEnv *, const char *, int,
+                               ERL_NIF_TERM (*)(ErlNifEnv *, int,
+                                                const ERL_NIF_TERM[]),
+                               int, const ERL_NIF_TERM[]) {
+  unsupported("enif_schedule_nif");
+}
+
+ErlNifThreadType enif_thread_type() { return ERL_NIF_THR_UNDEFINED; }
+
+int enif_is_binary(ErlNifEnv *, ERL_NIF_TERM) {
+  unsupported("enif_is_binary");
+}
+
+void enif_keep_resource(void *) { unsupported("enif_keep_resource"); }
+
+ERL_NIF_TERM enif_make_ref(ErlNifEnv *) { unsupported("enif_make_ref"); }
+
+// The benchmark runs as a single process, which never exits.
+ErlNifPid *enif_self(ErlNifEnv *, ErlNifPid *pid) {
+  std::memset(pid, 0, sizeof(*pid));
+  return pid;
+}
+
+int enif_is_process_alive(ErlNifEnv *, ErlNifPid *) { return 1; }
+
+ErlNifUInt64 enif_hash(ErlNifHash, ERL_NIF_TERM, ErlNifUInt64) {
+  unsupported("enif_hash");
+}
+
+int enif_send(ErlNifEnv *, const ErlNifPid *, ErlNifEnv *, ERL_NIF_TERM) {
+  unsupported("enif_send");
+}
+
+int enif_get_local_pid(ErlNifEnv *, ERL_NIF_TERM, ErlNifPid *) {
+  unsupported("enif_get_local_pid");
+}
+
+int enif_monitor_process(ErlNifEnv *, void *, const ErlNifPid *,
+                         ErlNifMonitor *) {
+  unsupported("enif_monitor_process");
+}
+
+} // extern "C"
@@ -0,0 +1,9 @@
+#include "erl_nif.h"
+
+/// Environment helpers for the benchmark. The stub environment is a bump
+/// arena which is reset between iterations instead of being garbage collected.
+ErlNifEnv *stub_env_new(void *priv_data);
+void stub_env_reset(ErlNifEnv *env);
+void stub_env_free(ErlNifEnv *env);
+/// Number of heap words allocated since the last reset.
+size_t stub_env_words(const ErlNifEnv *env);
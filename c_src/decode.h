@@ -0,0 +1,175 @@
+#pragma once
+
+#include "erl_nif.h"
+#include "simdjson.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// How non-integer numbers are returned, set with {floats, Format}
+enum float_format {
+  /// As Erlang floats
+  FLOATS_FLOAT,
+  /// As {Coefficient, Exponent}, both integers
+  FLOATS_DECIMAL,
+  /// As a binary of the number's text in the document
+  FLOATS_BINARY
+};
+
+/// How objects are returned, set with {objects, Format}
+enum object_format {
+  /// As maps
+  OBJECTS_MAP,
+  /// As [{Key, Value}] in document order
+  OBJECTS_PROPLIST,
+  /// As {[{Key, Value}]} in document order
+  OBJECTS_TUPLE_LIST
+};
+
+/// What happens to objects with duplicate keys, set with
+/// {duplicate_keys, Policy}
+enum duplicate_keys_policy {
+  /// The last value of the key is kept
+  DUPLICATE_KEYS_LAST,
+  /// The first value of the key is kept
+  DUPLICATE_KEYS_FIRST,
+  /// The document is rejected
+  DUPLICATE_KEYS_ERROR
+};
+
+struct result_cache;
+
+/// Options controlling the terms a document is converted to, given to
+/// esimdjson:new/1 or compiled once by esimdjson:decode_profile/1
+struct decode_options {
+  /// Whether integers too large for 64 bits are decoded to bignums
+  bool big_integers = false;
+  float_format floats = FLOATS_FLOAT;
+  object_format objects = OBJECTS_MAP;
+  duplicate_keys_policy duplicate_keys = DUPLICATE_KEYS_LAST;
+  /// Terms for null, true and false, or 0 for the atoms of the same name.
+  /// Atoms are used as they are, other terms live in the terms_env of the
+  /// resource holding the options.
+  ERL_NIF_TERM null_term = 0;
+  ERL_NIF_TERM true_term = 0;
+  ERL_NIF_TERM false_term = 0;
+  /// Milliseconds a document may take to decode, set with {deadline_ms, N},
+  /// or 0 for no deadline
+  uint64_t deadline_ms = 0;
+  /// Largest term a document may decode to, in heap words as estimated by
+  /// estimate_term_words, set with {max_term_words, N}, or 0 for no limit
+  size_t max_term_words = 0;
+  /// Cache of the terms decoded from binaries, set with {cache, Name}
+  result_cache *cache = nullptr;
+};
+
+/// Objects with up to this many keys are checked for duplicates with a hash
+/// table on the stack, wider ones with one in term_context::dedupe_slots.
+#define MAX_SMALL_DEDUPE_KEYS 32
+
+/// Errors from converting a parsed document, returned by make_term_from_dom
+enum term_error {
+  TERM_OK,
+  TERM_DUPLICATE_KEY,
+  TERM_DEADLINE,
+  TERM_CALLER_DOWN,
+  TERM_TOO_LARGE
+};
+
+/// A conversion checks its deadline and its caller once every this many
+/// values.
+#define CANCEL_CHECK_VALUES 4096
+
+/// Sizes of terms on a 64-bit heap, for estimate_term_words. Binaries up to
+/// HEAP_BINARY_LIMIT bytes are stored on the heap, larger ones are referenced
+/// from it with PROC_BIN_WORDS words.
+#define SMALL_INTEGER_BITS 60
+#define HEAP_BINARY_LIMIT 64
+#define PROC_BIN_WORDS 6
+/// Objects with more keys are stored as hashmaps rather than flatmaps
+#define FLATMAP_MAX_KEYS 32
+
+/// Longest integer literal decoded to a bignum. The conversion is quadratic in
+/// the number of digits, so longer ones are left to fail in simdjson.
+#define MAX_BIG_INTEGER_DIGITS 10000
+
+/// An integer literal too large for simdjson, taken out of the document
+struct big_integer {
+  /// Position of the literal among all the numbers of the document
+  size_t ordinal;
+  /// Offset and count of its digits in big_integer_table::digits
+  size_t offset;
+  size_t length;
+  bool negative;
+};
+
+/// The oversized integers of a document, in document order
+struct big_integer_table {
+  std::vector<big_integer> integers;
+  std::string digits;
+};
+
+/// State threaded through make_term_from_dom for a single document
+struct term_context {
+  /// Oversized integers of the document, or nullptr if it has none
+  const big_integer_table *big_integers = nullptr;
+  /// Numbers converted so far, only counted while big_integers is set
+  size_t numbers = 0;
+  /// Index of the next entry of big_integers->integers
+  size_t next_big_integer = 0;
+  decode_options options;
+  /// Terms for null, true and false in the env of the conversion, set by
+  /// make_term_from_dom
+  ERL_NIF_TERM null_term = 0;
+  ERL_NIF_TERM true_term = 0;
+  ERL_NIF_TERM false_term = 0;
+  /// Document being converted and cursor into its structural indexes, only
+  /// set when numbers are taken from their text
+  const char *source = nullptr;
+  const char *source_end = nullptr;
+  const uint32_t *structurals = nullptr;
+  const uint32_t *structurals_end = nullptr;
+  /// Terms of the children of the containers being converted
+  std::vector<ERL_NIF_TERM> stack;
+  /// Keys of the objects being converted, when they are checked for
+  /// duplicates
+  std::vector<std::string_view> keys;
+  /// Hash table of dedupe_keys for wide objects
+  std::vector<uint32_t> dedupe_slots;
+  /// Time by which the conversion must be done, in now_ns() terms, or 0
+  uint64_t deadline = 0;
+  /// Process whose exit stops the conversion, when watch_caller is set, and
+  /// the env to look it up from, nullptr on threads of our own
+  bool watch_caller = false;
+  ErlNifPid caller{};
+  ErlNifEnv *caller_env = nullptr;
+  /// Values left to convert before the deadline and the caller are checked
+  size_t until_check = CANCEL_CHECK_VALUES;
+};
+
+/// Converts a parsed document to Erlang terms, with the default options or
+/// those of ctx.options. Returns TERM_OK, or the term_error which stopped the
+/// conversion.
+int make_term_from_dom(ErlNifEnv *env, const simdjson::dom::element element,
+                       ERL_NIF_TERM *term);
+int make_term_from_dom(ErlNifEnv *env, const simdjson::dom::element element,
+                       ERL_NIF_TERM *term, term_context &ctx);
+/// Heap words of the terms make_term_from_dom would build for the document
+/// with the options of ctx, from a pass over the tape which builds nothing.
+/// Duplicate keys are counted, so the estimate is an upper bound for maps.
+/// The bytes of the binaries too large for the heap are added to
+/// `binary_bytes` if given.
+size_t estimate_term_words(const simdjson::dom::document &doc,
+                           term_context ctx, size_t *binary_bytes = nullptr);
+/// Heap words of the term make_term_from_dom would build for `element`, as
+/// estimate_term_words counts them for a document without its source. Stops
+/// at the first count above `limit`, so that it walks at most a few times
+/// `limit` values.
+size_t estimate_element_words(const simdjson::dom::element element,
+                              object_format objects, size_t limit);
+/// Hash of an object key for the dedupe and document index tables, which
+/// compare the keys of colliding slots
+uint64_t key_hash(std::string_view key);
+int dedupe_keys(term_context &ctx, size_t keys_base, size_t base,
+                size_t *count);
@@ -0,0 +1,296 @@
+#include "document_store.h"
+#include "decode.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+using key_field = std::pair<std::string_view, simdjson::dom::element>;
+
+/// The fields of a wide object, hashed with key_hash into open addressed
+/// slots
+struct key_table {
+  std::vector<key_field> fields;
+  /// Index into fields plus one, or 0 for an empty slot. A power of two, at
+  /// least twice the number of fields.
+  std::vector<uint32_t> slots;
+};
+
+struct object_index {
+  /// Lookups into the object so far, only counted until it is indexed
+  std::atomic<uint64_t> queries{0};
+  /// Set once, by the lookup which made queries reach index_after
+  std::atomic<key_table *> table{nullptr};
+
+  ~object_index() { delete table.load(std::memory_order_relaxed); }
+};
+
+/// Bytes charged for the query count of an object, with its node in the map,
+/// roughly
+#define OBJECT_INDEX_MEMORY (sizeof(object_index) + 4 * sizeof(void *))
+
+/// Published documents by name, protected by store_lock. Lookups only hold
+/// the lock for long enough to take a reference to a document, and convert
+/// it after releasing the lock, so a publish never waits for a conversion.
+static ErlNifRWLock *store_lock;
+static std::unordered_map<ERL_NIF_TERM, std::shared_ptr<stored_document>>
+    store;
+static std::atomic<size_t> store_memory{0};
+
+stored_document::stored_document(simdjson::dom::document &&doc, size_t size,
+                                 size_t memory)
+    : doc(std::move(doc)), size(size), memory(memory) {
+  index_lock = enif_rwlock_create((char *)"esimdjson_document_index");
+  store_memory.fetch_add(memory, std::memory_order_relaxed);
+}
+
+stored_document::~stored_document() {
+  if (index_lock)
+    enif_rwlock_destroy(index_lock);
+  store_memory.fetch_sub(memory + index_memory.load(std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+}
+
+/// Charges `bytes` to the indexes of the document. Returns false, charging
+/// nothing, if that would take them over max_index_memory.
+static bool reserve_index_memory(stored_document &stored, size_t bytes) {
+  size_t used = stored.index_memory.load(std::memory_order_relaxed);
+  do {
+    if (used + bytes > stored.max_index_memory)
+      return false;
+  } while (!stored.index_memory.compare_exchange_weak(
+      used, used + bytes, std::memory_order_relaxed));
+  store_memory.fetch_add(bytes, std::memory_order_relaxed);
+
+  return true;
+}
+
+/// Returns the index entry of the object whose first key is at `first_key`,
+/// created if need be, or nullptr if the indexes are out of memory.
+static object_index *find_object_index(stored_document &stored,
+                                       const char *first_key) {
+  object_index *index = nullptr;
+  enif_rwlock_rlock(stored.index_lock);
+  auto it = stored.indexes.find(first_key);
+  if (it != stored.indexes.end())
+    index = it->second.get();
+  enif_rwlock_runlock(stored.index_lock);
+  if (index)
+    return index;
+
+  enif_rwlock_rwlock(stored.index_lock);
+  it = stored.indexes.find(first_key);
+  if (it != stored.indexes.end())
+    index = it->second.get();
+  else if (reserve_index_memory(stored, OBJECT_INDEX_MEMORY)) {
+    index = new object_index();
+    stored.indexes.emplace(first_key, std::unique_ptr<object_index>(index));
+  }
+  enif_rwlock_rwunlock(stored.index_lock);
+
+  return index;
+}
+
+static key_table *build_key_table(stored_document &stored,
+                                  simdjson::dom::object object) {
+  // The tape only counts up to 0xFFFFFF fields, beyond which the object is
+  // left to at_key.
+  size_t n = object.size();
+  if (n >= 0xFFFFFF)
+    return nullptr;
+  size_t n_slots = 2;
+  while (n_slots < 2 * n)
+    n_slots <<= 1;
+  size_t bytes = sizeof(key_table) + n * sizeof(key_field) +
+                 n_slots * sizeof(uint32_t);
+  if (!reserve_index_memory(stored, bytes))
+    return nullptr;
+
+  key_table *table = new key_table();
+  table->fields.reserve(n);
+  table->slots.assign(n_slots, 0);
+  size_t mask = n_slots - 1;
+  for (simdjson::dom::key_value_pair field : object) {
+    size_t i = key_hash(field.key) & mask;
+    bool duplicate = false;
+    for (uint32_t slot; !duplicate && (slot = table->slots[i]);
+         i = (i + 1) & mask)
+      duplicate = table->fields[slot - 1].first == field.key;
+    // at_key returns the first of duplicate keys.
+    if (duplicate)
+      continue;
+    table->fields.emplace_back(field.key, field.value);
+    table->slots[i] = table->fields.size();
+  }
+  stored.indexed_objects.fetch_add(1, std::memory_order_relaxed);
+
+  return table;
+}
+
+static simdjson::error_code find_field(stored_document &stored,
+                                       simdjson::dom::object object,
+                                       std::string_view key,
+                                       simdjson::dom::element *value,
+                                       bool *deferred) {
+  object_index *index = nullptr;
+  bool wide = object.size() >= INDEX_MIN_KEYS;
+  if (wide)
+    index = find_object_index(stored, object.begin().key_c_str());
+
+  key_table *table =
+      index ? index->table.load(std::memory_order_acquire) : nullptr;
+  // Not counted as a query, as the lookup is done again.
+  if (wide && !table && deferred) {
+    *deferred = true;
+    return simdjson::SUCCESS;
+  }
+  if (index && !table &&
+      index->queries.fetch_add(1, std::memory_order_relaxed) ==
+          stored.index_after) {
+    table = build_key_table(stored, object);
+    index->table.store(table, std::memory_order_release);
+  }
+  if (!table)
+    return object.at_key(key).get(*value);
+
+  size_t mask = table->slots.size() - 1;
+  for (size_t i = key_hash(key) & mask; uint32_t slot = table->slots[i];
+       i = (i + 1) & mask)
+    if (table->fields[slot - 1].first == key) {
+      *value = table->fields[slot - 1].second;
+      return simdjson::SUCCESS;
+    }
+
+  return simdjson::NO_SUCH_FIELD;
+}
+
+/// Replaces the ~0 and ~1 escapes of a reference token with ~ and /.
+static simdjson::error_code unescape_token(std::string_view token,
+                                           std::string &unescaped) {
+  unescaped.clear();
+  for (size_t i = 0; i < token.size(); i++) {
+    if (token[i] != '~') {
+      unescaped += token[i];
+      continue;
+    }
+    char escape = i + 1 < token.size() ? token[++i] : 0;
+    if (escape != '0' && escape != '1')
+      return simdjson::INVALID_JSON_POINTER;
+    unescaped += escape == '0' ? '~' : '/';
+  }
+
+  return simdjson::SUCCESS;
+}
+
+int document_store_start() {
+  store_lock = enif_rwlock_create((char *)"esimdjson_document_store");
+  return store_lock ? 0 : -1;
+}
+
+void document_store_stop() {
+  store.clear();
+  if (store_lock)
+    enif_rwlock_destroy(store_lock);
+  store_lock = nullptr;
+}
+
+void document_store_publish(ERL_NIF_TERM name,
+                            std::shared_ptr<stored_document> doc) {
+  // The replaced document is released after the lock, as freeing its tape
+  // may take a while.
+  enif_rwlock_rwlock(store_lock);
+  store[name].swap(doc);
+  enif_rwlock_rwunlock(store_lock);
+}
+
+std::shared_ptr<stored_document> document_store_find(ERL_NIF_TERM name) {
+  std::shared_ptr<stored_document> doc;
+  enif_rwlock_rlock(store_lock);
+  auto it = store.find(name);
+  if (it != store.end())
+    doc = it->second;
+  enif_rwlock_runlock(store_lock);
+
+  return doc;
+}
+
+std::shared_ptr<stored_document> document_store_remove(ERL_NIF_TERM name) {
+  std::shared_ptr<stored_document> doc;
+  enif_rwlock_rwlock(store_lock);
+  auto it = store.find(name);
+  if (it != store.end()) {
+    doc.swap(it->second);
+    store.erase(it);
+  }
+  enif_rwlock_rwunlock(store_lock);
+
+  return doc;
+}
+
+size_t document_store_memory() {
+  return store_memory.load(std::memory_order_relaxed);
+}
+
+simdjson::error_code document_store_at_pointer(stored_document &stored,
+                                               std::string_view pointer,
+                                               simdjson::dom::element *value,
+                                               bool *deferred) {
+  // One reference token at a time, returning the same errors as
+  // element::at_pointer.
+  simdjson::dom::element element = stored.doc.root();
+  std::string unescaped;
+  while (!pointer.empty()) {
+    if (pointer[0] != '/')
+      return simdjson::INVALID_JSON_POINTER;
+    pointer.remove_prefix(1);
+    std::string_view token = pointer.substr(0, pointer.find('/'));
+    pointer.remove_prefix(token.size());
+
+    simdjson::error_code error;
+    switch (element.type()) {
+    case simdjson::dom::element_type::OBJECT: {
+      if (token.find('~') != std::string_view::npos) {
+        error = unescape_token(token, unescaped);
+        if (error)
+          return error;
+        token = unescaped;
+      }
+      simdjson::dom::object object;
+      error = element.get(object);
+      if (error)
+        return error;
+      error = find_field(stored, object, token, &element, deferred);
+      if (!error && deferred && *deferred)
+        return simdjson::SUCCESS;
+      break;
+    }
+    case simdjson::dom::element_type::ARRAY: {
+      // "-" is the position after the last element, which is never a value.
+      if (token == "-")
+        return simdjson::INDEX_OUT_OF_BOUNDS;
+      size_t index = 0;
+      for (char c : token) {
+        uint8_t digit = uint8_t(c - '0');
+        if (digit > 9)
+          return simdjson::INCORRECT_TYPE;
+        index = index * 10 + digit;
+      }
+      if (token.empty() || (token.size() > 1 && token[0] == '0'))
+        return simdjson::INVALID_JSON_POINTER;
+      simdjson::dom::array array;
+      error = element.get(array);
+      if (error)
+        return error;
+      error = array.at(index).get(element);
+      break;
+    }
+    default:
+      return simdjson::INVALID_JSON_POINTER;
+    }
+    if (error)
+      return error;
+  }
+  *value = element;
+
+  return simdjson::SUCCESS;
+}
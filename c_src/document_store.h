@@ -0,0 +1,71 @@
+#include "erl_nif.h"
+#include "simdjson.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+/// Objects with fewer keys are always scanned, as at_key does
+#define INDEX_MIN_KEYS 64
+/// Lookups into a wide object before it is indexed, when publish is not
+/// given {index_after, N}
+#define INDEX_DEFAULT_AFTER 8
+
+struct object_index;
+
+/// A document published with esimdjson:publish/2. It is never written to
+/// once published, so any number of threads may read it at once, except for
+/// the key indexes of its wide objects, which are built as they are queried.
+struct stored_document {
+  simdjson::dom::document doc;
+  /// Bytes of the JSON text it was parsed from
+  size_t size;
+  /// Bytes held by the tape and string buffer, counted in
+  /// document_store_memory until the document is freed
+  size_t memory;
+  /// Lookups into an object before its keys are indexed
+  uint64_t index_after = INDEX_DEFAULT_AFTER;
+  /// Bytes the indexes may hold, and hold so far, also counted in
+  /// document_store_memory
+  size_t max_index_memory = 0;
+  std::atomic<size_t> index_memory{0};
+  std::atomic<size_t> indexed_objects{0};
+  /// Query counts and indexes of the wide objects looked into, by the
+  /// address of their first key, protected by index_lock. Entries are only
+  /// freed with the document, so they are used after releasing the lock.
+  ErlNifRWLock *index_lock;
+  std::unordered_map<const char *, std::unique_ptr<object_index>> indexes;
+
+  stored_document(simdjson::dom::document &&doc, size_t size, size_t memory);
+  ~stored_document();
+};
+
+/// Creates the registry of published documents. Returns 0 on success.
+int document_store_start();
+/// Drops every published document. Documents still being read by a lookup
+/// are freed when the lookup is done with them.
+void document_store_stop();
+/// Publishes `doc` under the atom `name`, replacing the document published
+/// under it, which is freed once the lookups still reading it are done.
+void document_store_publish(ERL_NIF_TERM name,
+                            std::shared_ptr<stored_document> doc);
+/// Returns the document published under the atom `name`, or nullptr.
+std::shared_ptr<stored_document> document_store_find(ERL_NIF_TERM name);
+/// Removes the document published under the atom `name`, and returns it, or
+/// nullptr if there was none.
+std::shared_ptr<stored_document> document_store_remove(ERL_NIF_TERM name);
+/// Bytes held by published documents and their indexes, including replaced
+/// documents which are still being read
+size_t document_store_memory();
+/// Finds the value at a JSON pointer, as dom::element::at_pointer does, but
+/// through the key index of every wide object which has been looked into
+/// index_after times, building it if need be. If `deferred` is given, a
+/// lookup which would have to scan or index a wide object stops there
+/// instead, setting it to true, so that it can be done again on a dirty
+/// scheduler.
+simdjson::error_code document_store_at_pointer(stored_document &stored,
+                                               std::string_view pointer,
+                                               simdjson::dom::element *value,
+                                               bool *deferred = nullptr);
@@ -1,13 +1,27 @@
 #include "esimdjson.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
 int load(ErlNifEnv *env, void **priv_data, const ERL_NIF_TERM load_info) {
   ErlNifResourceFlags flags =
       ErlNifResourceFlags(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER);
-  ErlNifResourceType *res_type = enif_open_resource_type(
-      env, nullptr, "esimdjson_dom_parser", dom_parser_dtor, flags, nullptr);
+  ErlNifResourceTypeInit init = {};
+  init.dtor = dom_parser_dtor;
+  init.down = dom_parser_down;
+  ErlNifResourceType *res_type = enif_open_resource_type_x(
+      env, "esimdjson_dom_parser", &init, flags, nullptr);
   if (!res_type)
     return -1;
   *priv_data = (void *)res_type;
+  decode_profile_type = enif_open_resource_type(
+      env, nullptr, "esimdjson_decode_profile", decode_profile_dtor, flags,
+      nullptr);
+  if (!decode_profile_type)
+    return -1;
 
   // Make atoms
   // Static variables are used here to avoid making atoms in the NIF callbacks.
@@ -20,10 +34,95 @@ int load(ErlNifEnv *env, void **priv_data, const ERL_NIF_TERM load_info) {
   atom_false = enif_make_atom(env, "false");
   atom_fixed_capacity = enif_make_atom(env, "fixed_capacity");
   atom_max_capacity = enif_make_atom(env, "max_capacity");
+  atom_max_depth = enif_make_atom(env, "max_depth");
+  atom_implementation = enif_make_atom(env, "implementation");
+  atom_shrink_after = enif_make_atom(env, "shrink_after");
+  atom_async_free_threshold = enif_make_atom(env, "async_free_threshold");
+  atom_owner = enif_make_atom(env, "owner");
+  atom_owner_down = enif_make_atom(env, "owner_down");
+  atom_big_integers = enif_make_atom(env, "big_integers");
+  atom_floats = enif_make_atom(env, "floats");
+  atom_float = enif_make_atom(env, "float");
+  atom_decimal = enif_make_atom(env, "decimal");
+  atom_binary = enif_make_atom(env, "binary");
+  atom_objects = enif_make_atom(env, "objects");
+  atom_map = enif_make_atom(env, "map");
+  atom_proplist = enif_make_atom(env, "proplist");
+  atom_tuple_list = enif_make_atom(env, "tuple_list");
+  atom_duplicate_keys = enif_make_atom(env, "duplicate_keys");
+  atom_first = enif_make_atom(env, "first");
+  atom_last = enif_make_atom(env, "last");
+  atom_null_term = enif_make_atom(env, "null_term");
+  atom_true_term = enif_make_atom(env, "true_term");
+  atom_false_term = enif_make_atom(env, "false_term");
+  atom_pool_workers = enif_make_atom(env, "pool_workers");
+  atom_esimdjson = enif_make_atom(env, "esimdjson");
+  atom_deadline_ms = enif_make_atom(env, "deadline_ms");
+  atom_max_term_words = enif_make_atom(env, "max_term_words");
+  atom_cache = enif_make_atom(env, "cache");
+  atom_max_memory = enif_make_atom(env, "max_memory");
+  atom_index_after = enif_make_atom(env, "index_after");
+  atom_not_found = enif_make_atom(env, "not_found");
+  atom_max_index_memory = enif_make_atom(env, "max_index_memory");
+
+  // Application environment settings passed by esimdjson:init/0.
+  // An implementation which is unknown or unsupported by this host fails the
+  // load, rather than silently running a different kernel than requested.
+  ERL_NIF_TERM opt_cdr = load_info;
+  ERL_NIF_TERM opt_car;
+  size_t workers = std::max(std::thread::hardware_concurrency(), 1u);
+  while (enif_get_list_cell(env, opt_cdr, &opt_car, &opt_cdr)) {
+    const simdjson::implementation *impl;
+    if (get_implementation(env, opt_car, &impl)) {
+      if (!impl->supported_by_runtime_system())
+        return -1;
+      simdjson::active_implementation = impl;
+    } else if (get_async_free_threshold(env, opt_car, &async_free_threshold))
+      continue;
+    else if (get_pool_workers(env, opt_car, &workers))
+      continue;
+    else
+      return -1;
+  }
+
+  // Each start undoes its own partial work when it fails, and a failed start
+  // stops the ones before it in reverse order, so that a failed load leaves
+  // no threads or locks behind.
+  if (start_free_thread())
+    return -1;
+  if (result_cache_start()) {
+    stop_free_thread();
+    return -1;
+  }
+  if (document_store_start()) {
+    result_cache_stop();
+    stop_free_thread();
+    return -1;
+  }
+  pool_workers.reset(new pool_worker[workers]);
+  if (thread_pool_start(workers)) {
+    pool_workers.reset();
+    document_store_stop();
+    result_cache_stop();
+    stop_free_thread();
+    return -1;
+  }
 
   return 0;
 }
 
+void unload(ErlNifEnv *env, void *priv_data) {
+  size_t workers = thread_pool_workers();
+  thread_pool_stop();
+  for (size_t i = 0; i < workers; i++)
+    memory_held.fetch_sub(pool_workers[i].accounted_memory,
+                          std::memory_order_relaxed);
+  pool_workers.reset();
+  document_store_stop();
+  result_cache_stop();
+  stop_free_thread();
+}
+
 ERL_NIF_TERM make_atom(ErlNifEnv *env, const char *atom) {
   ERL_NIF_TERM ret;
 
@@ -53,12 +152,35 @@ ERL_NIF_TERM make_simdjson_error(ErlNifEnv *env,
   return make_error(env, reason);
 }
 
+ERL_NIF_TERM make_owner_down_error(ErlNifEnv *env) {
+  ERL_NIF_TERM reason_str = enif_make_string(
+      env, "The process owning the parser has exited", ERL_NIF_LATIN1);
+  ERL_NIF_TERM reason = enif_make_tuple2(env, atom_owner_down, reason_str);
+
+  return make_error(env, reason);
+}
+
+ERL_NIF_TERM make_term_error(ErlNifEnv *env, const term_error error) {
+  ERL_NIF_TERM reason_atom = make_atom(env, term_error_txt[error].atom);
+  ERL_NIF_TERM reason_str =
+      enif_make_string(env, term_error_txt[error].message, ERL_NIF_LATIN1);
+  ERL_NIF_TERM reason = enif_make_tuple2(env, reason_atom, reason_str);
+
+  return make_error(env, reason);
+}
+
 ERL_NIF_TERM nif_new(ErlNifEnv *env, const int argc,
                      const ERL_NIF_TERM argv[]) {
   ERL_NIF_TERM opt_cdr;
   ERL_NIF_TERM opt_car;
   size_t max_cap = 0;
   size_t fixed_cap = 0;
+  size_t max_depth = simdjson::DEFAULT_MAX_DEPTH;
+  size_t shrink_after = 0;
+  const simdjson::implementation *impl = nullptr;
+  ErlNifPid owner;
+  bool has_owner = false;
+  decode_options options;
 
   if (argc != 1 || !enif_is_list(env, (opt_cdr = argv[0])))
     return enif_make_badarg(env);
@@ -68,10 +190,23 @@ ERL_NIF_TERM nif_new(ErlNifEnv *env, const int argc,
       continue;
     else if (get_fixed_capacity(env, opt_car, &fixed_cap))
       continue;
+    else if (get_max_depth(env, opt_car, &max_depth))
+      continue;
+    else if (get_shrink_after(env, opt_car, &shrink_after))
+      continue;
+    else if (get_implementation(env, opt_car, &impl))
+      continue;
+    else if (get_owner(env, opt_car, &owner))
+      has_owner = true;
+    else if (get_decode_option(env, opt_car, &options))
+      continue;
     else
       return enif_make_badarg(env);
   }
 
+  if (impl && !impl->supported_by_runtime_system())
+    return make_simdjson_error(env, simdjson::UNSUPPORTED_ARCHITECTURE);
+
   // It only makes sense to specify one of fixed_capacity or max_capacity
   if (max_cap && fixed_cap)
     return enif_make_badarg(env);
@@ -79,33 +214,67 @@ ERL_NIF_TERM nif_new(ErlNifEnv *env, const int argc,
   ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
 
   void *parser_res =
-      enif_alloc_resource(res_type, sizeof(simdjson::dom::parser));
+      enif_alloc_resource(res_type, sizeof(dom_parser_resource));
+  dom_parser_resource *res = new (parser_res) dom_parser_resource();
+  ERL_NIF_TERM res_term = enif_make_resource(env, parser_res);
+  enif_release_resource(parser_res);
+  res->shrink_after = shrink_after;
+  res->options = options;
+  if (keep_literal_terms(env, &res->options, &res->terms_env))
+    return make_simdjson_error(env, simdjson::MEMALLOC);
+
+  // The mutex is only needed to synchronise with the down callback, so
+  // parsers without an owner go without.
+  if (has_owner) {
+    res->mutex = enif_mutex_create((char *)"esimdjson_dom_parser");
+    if (!res->mutex)
+      return make_simdjson_error(env, simdjson::MEMALLOC);
+    if (enif_monitor_process(env, parser_res, &owner, &res->owner_monitor))
+      return make_owner_down_error(env);
+  }
+
+  // Pin the parser to the requested implementation. dom::parser only creates
+  // its implementation when it has none, so every later allocation of this
+  // parser keeps using the same one.
+  if (impl) {
+    auto error = impl->create_dom_parser_implementation(
+        0, max_depth, res->parser.implementation);
+    if (error)
+      return make_simdjson_error(env, error);
+  } else if (max_depth != simdjson::DEFAULT_MAX_DEPTH) {
+    // The parser grows its buffers with the depth of its implementation, so
+    // create that up front for a non-default depth.
+    auto error = res->parser.allocate(0, max_depth);
+    if (error)
+      return make_simdjson_error(env, error);
+  }
 
-  simdjson::dom::parser *parser;
   if (max_cap)
-    parser = new (parser_res) simdjson::dom::parser(max_cap);
+    res->parser.set_max_capacity(max_cap);
   else if (fixed_cap) {
-    parser = new (parser_res) simdjson::dom::parser(0);
-    auto error = parser->allocate(fixed_cap);
+    res->parser.set_max_capacity(0);
+    auto error = res->parser.allocate(fixed_cap, max_depth);
     if (error)
       return enif_make_badarg(env);
-  } else
-    parser = new (parser_res) simdjson::dom::parser();
-
-  ERL_NIF_TERM res_term = enif_make_resource(env, parser_res);
-  enif_release_resource(parser_res);
+    res->stats.peak_capacity.store(fixed_cap, std::memory_order_relaxed);
+  }
+  account_memory(res);
 
   return make_ok_result(env, res_term);
 }
 
 ERL_NIF_TERM nif_load(ErlNifEnv *env, const int argc,
                       const ERL_NIF_TERM argv[]) {
-  if (argc != 2)
+  if (argc != 2 && argc != 3)
     return enif_make_badarg(env);
 
   ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
-  simdjson::dom::parser *pparser;
-  if (!enif_get_resource(env, argv[0], res_type, (void **)&pparser))
+  dom_parser_resource *res;
+  if (!enif_get_resource(env, argv[0], res_type, (void **)&res))
+    return enif_make_badarg(env);
+
+  const decode_options *options = &res->options;
+  if (argc == 3 && !get_profile(env, argv[2], &options))
     return enif_make_badarg(env);
 
   unsigned int path_size;
@@ -115,162 +284,2572 @@ ERL_NIF_TERM nif_load(ErlNifEnv *env, const int argc,
   if (!enif_get_string(env, argv[1], path.get(), path_size + 1, ERL_NIF_LATIN1))
     return enif_make_badarg(env);
 
-  simdjson::dom::element element;
-
-  auto error = pparser->load(path.get()).get(element);
+  // The file is read on this dirty I/O scheduler into the parser's load
+  // buffer, where the parse rescheduled on a dirty CPU scheduler finds it.
+  if (!enter_parser(res))
+    return make_owner_down_error(env);
+  uint64_t start = now_ns();
+  size_t len = 0;
+  auto error =
+      read_file(path.get(), res->load_buf, res->load_buf_capacity, &len);
+  uint64_t generation = ++res->load_buf_generation;
+  leave_parser(res);
   if (error) {
+    record_parse(res, HISTOGRAM_LOAD, len, error, now_ns() - start);
+    track_document(res, len);
     return make_simdjson_error(env, error);
   }
 
+  ERL_NIF_TERM args[5] = {argv[0], enif_make_uint64(env, len),
+                          enif_make_uint64(env, start),
+                          enif_make_uint64(env, generation)};
+  if (argc == 3)
+    args[4] = argv[2];
+  return enif_schedule_nif(env, "load", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                           nif_load_parse, argc + 2, args);
+}
+
+ERL_NIF_TERM nif_load_parse(ErlNifEnv *env, const int argc,
+                            const ERL_NIF_TERM argv[]) {
+  // Called as load_parse(Parser, Length, Start, Generation) or
+  // load_parse(Parser, Length, Start, Generation, Profile) by nif_load.
+  ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
+  dom_parser_resource *res;
+  ErlNifUInt64 len, start, generation;
+  if (!enif_get_resource(env, argv[0], res_type, (void **)&res) ||
+      !enif_get_uint64(env, argv[1], &len) ||
+      !enif_get_uint64(env, argv[2], &start) ||
+      !enif_get_uint64(env, argv[3], &generation))
+    return enif_make_badarg(env);
+
+  const decode_options *options = &res->options;
+  if (argc == 5 && !get_profile(env, argv[4], &options))
+    return enif_make_badarg(env);
+
+  // The parser is not kept busy between the two phases, so that a process
+  // killed in between cannot leave it busy forever. An owner exiting in
+  // between drops the buffer read, and is reported here. A trim or another
+  // call on the parser in between may have freed or overwritten the buffer,
+  // which is then not parsed.
+  if (!enter_parser(res))
+    return make_owner_down_error(env);
   ERL_NIF_TERM result;
-  make_term_from_dom(env, element, &result);
+  if (!res->load_buf || len > res->load_buf_capacity ||
+      generation != res->load_buf_generation) {
+    record_parse(res, HISTOGRAM_LOAD, len, simdjson::PARSER_IN_USE,
+                 now_ns() - start);
+    result = make_simdjson_error(env, simdjson::PARSER_IN_USE);
+  } else
+    result = load_document(env, res, len, start, *options);
+  leave_parser(res);
 
-  return make_ok_result(env, result);
+  return result;
 }
 
 ERL_NIF_TERM nif_parse(ErlNifEnv *env, const int argc,
                        const ERL_NIF_TERM argv[]) {
-  if (argc != 2)
+  if (argc != 2 && argc != 3)
     return enif_make_badarg(env);
 
   ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
-  simdjson::dom::parser *pparser;
-  if (!enif_get_resource(env, argv[0], res_type, (void **)&pparser))
+  dom_parser_resource *res;
+  if (!enif_get_resource(env, argv[0], res_type, (void **)&res))
+    return enif_make_badarg(env);
+
+  const decode_options *options = &res->options;
+  if (argc == 3 && !get_profile(env, argv[2], &options))
     return enif_make_badarg(env);
 
   ErlNifBinary bin;
   if (!enif_inspect_binary(env, argv[1], &bin))
     return enif_make_badarg(env);
 
-  simdjson::dom::element element;
-  auto error = pparser->parse((char *)bin.data, bin.size).get(element);
-  if (error)
-    return make_simdjson_error(env, error);
-
-  ERL_NIF_TERM result;
-  make_term_from_dom(env, element, &result);
+  if (!enter_parser(res))
+    return make_owner_down_error(env);
+  ERL_NIF_TERM result = parse_document(env, res, bin, *options);
+  leave_parser(res);
 
-  return make_ok_result(env, result);
+  return result;
 }
 
-ERL_NIF_TERM nif_max_capacity(ErlNifEnv *env, const int argc,
-                              const ERL_NIF_TERM argv[]) {
-  if (argc != 1)
+ERL_NIF_TERM nif_parse_batch(ErlNifEnv *env, const int argc,
+                             const ERL_NIF_TERM argv[]) {
+  // Called as parse_batch(Parser, Binaries), and rescheduled with the
+  // remaining binaries and the results so far, most recent first.
+  if (argc != 2 && argc != 3)
     return enif_make_badarg(env);
 
   ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
-  simdjson::dom::parser *pparser;
-  if (!enif_get_resource(env, argv[0], res_type, (void **)&pparser))
+  dom_parser_resource *res;
+  if (!enif_get_resource(env, argv[0], res_type, (void **)&res))
     return enif_make_badarg(env);
 
-  ERL_NIF_TERM result = enif_make_uint64(env, pparser->max_capacity());
+  ERL_NIF_TERM rest = argv[1];
+  ERL_NIF_TERM results = argc == 3 ? argv[2] : enif_make_list(env, 0);
+  bool dirty = enif_thread_type() == ERL_NIF_THR_DIRTY_CPU_SCHEDULER;
+  uint64_t slice_start = now_ns();
+  ERL_NIF_TERM head;
+  while (enif_get_list_cell(env, rest, &head, &rest)) {
+    ErlNifBinary bin;
+    if (!enif_inspect_binary(env, head, &bin))
+      return enif_make_badarg(env);
 
-  return make_ok_result(env, result);
+    // Dirty schedulers are not preempted, so a batch moved there for a large
+    // document runs to its end.
+    if (!dirty && bin.size >= BATCH_MAX_INLINE_SIZE) {
+      ERL_NIF_TERM args[3] = {argv[0], enif_make_list_cell(env, head, rest),
+                              results};
+      return enif_schedule_nif(env, "parse_batch", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                               nif_parse_batch, 3, args);
+    }
+
+    ERL_NIF_TERM result;
+    if (enter_parser(res)) {
+      result = parse_document(env, res, bin, res->options);
+      leave_parser(res);
+    } else
+      result = make_owner_down_error(env);
+    results = enif_make_list_cell(env, result, results);
+
+    if (dirty)
+      continue;
+    uint64_t elapsed = now_ns() - slice_start;
+    if (elapsed >= TIMESLICE_NS / 10) {
+      int percent = std::min<uint64_t>(elapsed * 100 / TIMESLICE_NS, 100);
+      slice_start = now_ns();
+      if (enif_consume_timeslice(env, percent)) {
+        ERL_NIF_TERM args[3] = {argv[0], rest, results};
+        return enif_schedule_nif(env, "parse_batch", 0, nif_parse_batch, 3,
+                                 args);
+      }
+    }
+  }
+  if (!enif_is_empty_list(env, rest))
+    return enif_make_badarg(env);
+
+  ERL_NIF_TERM list;
+  enif_make_reverse_list(env, results, &list);
+  return list;
 }
 
-int get_max_capacity(ErlNifEnv *env, const ERL_NIF_TERM opt, size_t *max_cap) {
-  int arity = 0;
-  int ret = 0;
-  const ERL_NIF_TERM *tuple_array;
-  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
-      enif_is_identical(tuple_array[0], atom_max_capacity) &&
-      enif_get_uint64(env, tuple_array[1], max_cap))
-    ret = 1;
+ERL_NIF_TERM nif_parse_parallel(ErlNifEnv *env, const int argc,
+                                const ERL_NIF_TERM argv[]) {
+  ERL_NIF_TERM opt_cdr;
+  ERL_NIF_TERM opt_car;
+  decode_options options;
+  unsigned count;
 
-  return ret;
+  if (argc != 2 || !enif_get_list_length(env, argv[0], &count) ||
+      !enif_is_list(env, (opt_cdr = argv[1])))
+    return enif_make_badarg(env);
+
+  while (enif_get_list_cell(env, opt_cdr, &opt_car, &opt_cdr)) {
+    if (!get_decode_option(env, opt_car, &options))
+      return enif_make_badarg(env);
+  }
+
+  // The terms of the options stay valid for the whole call, so they are not
+  // copied as for a parser or profile.
+  std::unique_ptr<parallel_document[]> documents{
+      new parallel_document[count]};
+  ERL_NIF_TERM bin_cdr = argv[0];
+  ERL_NIF_TERM bin_car;
+  for (unsigned i = 0; enif_get_list_cell(env, bin_cdr, &bin_car, &bin_cdr);
+       i++) {
+    if (!enif_inspect_binary(env, bin_car, &documents[i].bin))
+      return enif_make_badarg(env);
+  }
+
+  parallel_job job;
+  job.documents = documents.get();
+  job.count = count;
+  job.options = &options;
+
+  return run_parallel_job(env, job);
 }
 
-int get_fixed_capacity(ErlNifEnv *env, const ERL_NIF_TERM opt,
-                       size_t *fixed_cap) {
-  int arity = 0;
-  int ret = 0;
-  const ERL_NIF_TERM *tuple_array;
-  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
-      enif_is_identical(tuple_array[0], atom_fixed_capacity) &&
-      enif_get_uint64(env, tuple_array[1], fixed_cap))
-    ret = 1;
+ERL_NIF_TERM nif_load_batch(ErlNifEnv *env, const int argc,
+                            const ERL_NIF_TERM argv[]) {
+  ERL_NIF_TERM opt_cdr;
+  ERL_NIF_TERM opt_car;
+  decode_options options;
+  unsigned count;
 
-  return ret;
+  if (argc != 2 || !enif_get_list_length(env, argv[0], &count) ||
+      !enif_is_list(env, (opt_cdr = argv[1])))
+    return enif_make_badarg(env);
+
+  while (enif_get_list_cell(env, opt_cdr, &opt_car, &opt_cdr)) {
+    if (!get_decode_option(env, opt_car, &options))
+      return enif_make_badarg(env);
+  }
+
+  std::unique_ptr<parallel_document[]> documents{
+      new parallel_document[count]};
+  ERL_NIF_TERM path_cdr = argv[0];
+  ERL_NIF_TERM path_car;
+  for (unsigned i = 0; enif_get_list_cell(env, path_cdr, &path_car, &path_cdr);
+       i++) {
+    unsigned int path_size;
+    if (!enif_get_list_length(env, path_car, &path_size))
+      return enif_make_badarg(env);
+    std::string &path = documents[i].path;
+    path.resize(path_size + 1);
+    if (!enif_get_string(env, path_car, path.data(), path_size + 1,
+                         ERL_NIF_LATIN1) ||
+        path_size == 0)
+      return enif_make_badarg(env);
+    path.resize(path_size);
+  }
+
+  parallel_job job;
+  job.documents = documents.get();
+  job.count = count;
+  job.options = &options;
+
+  return run_parallel_job(env, job);
 }
 
-int make_term_from_dom(ErlNifEnv *env, const simdjson::dom::element element,
-                       ERL_NIF_TERM *term) {
-  switch (element.type()) {
-  case simdjson::dom::element_type::INT64:
-    *term = enif_make_int64(env, int64_t(element));
-    break;
-  case simdjson::dom::element_type::UINT64:
-    *term = enif_make_uint64(env, uint64_t(element));
-    break;
-  case simdjson::dom::element_type::DOUBLE:
-    *term = enif_make_double(env, double(element));
-    break;
-  case simdjson::dom::element_type::BOOL: {
-    *term = bool(element) ? atom_true : atom_false;
-  } break;
-  case simdjson::dom::element_type::NULL_VALUE: {
-    *term = atom_null;
-  } break;
-  case simdjson::dom::element_type::STRING: {
-    std::string_view str = std::string_view(element);
-    char *str_bin = (char *)enif_make_new_binary(env, str.size(), term);
-    str.copy(str_bin, str.size());
-  } break;
-  case simdjson::dom::element_type::OBJECT: {
-    simdjson::dom::object obj = simdjson::dom::object(element);
-    // TODO: VLAs are (probably?) a bad idea. Use something
-    // which is more explicit about asking for stack memory.
-    ERL_NIF_TERM keys[obj.size()];
-    ERL_NIF_TERM values[obj.size()];
+ERL_NIF_TERM run_parallel_job(ErlNifEnv *env, parallel_job &job) {
+  uint64_t job_start = now_ns();
+  job.deadline = deadline_from(*job.options, job_start);
+  ErlNifPid caller;
+  enif_self(env, &caller);
+  job.mutex = enif_mutex_create((char *)"esimdjson_parallel_job");
+  job.cond = enif_cond_create((char *)"esimdjson_parallel_job");
+  job.ahead_cond = enif_cond_create((char *)"esimdjson_parallel_ahead");
+  bool failed = !job.mutex || !job.cond || !job.ahead_cond;
+  job.running = failed ? 0 : std::min(thread_pool_workers(), job.count);
+  job.ahead = PARALLEL_AHEAD_PER_WORKER * job.running;
+  std::unique_ptr<parallel_task[]> tasks{new parallel_task[job.running]};
+  for (size_t i = 0; i < job.running; i++) {
+    tasks[i].task.run = run_parallel_task;
+    tasks[i].job = &job;
+    thread_pool_submit(&tasks[i].task);
+  }
 
-    size_t i = 0;
-    for (auto [key, value] : obj) {
-      ERL_NIF_TERM k;
-      char *k_bin = (char *)enif_make_new_binary(env, key.size(), &k);
-      key.copy(k_bin, key.size());
+  // Documents are converted in order as soon as they are parsed, while the
+  // workers go on with the next ones, and are freed once converted. The
+  // workers stay at most `ahead` documents ahead, so that only that many
+  // tapes are held at once however slow the conversion is.
+  std::vector<ERL_NIF_TERM> results(job.count);
+  uint64_t convert_ns = 0;
+  size_t bytes = 0;
+  for (size_t i = 0; i < job.count; i++) {
+    parallel_document &document = job.documents[i];
+    if (!failed) {
+      enif_mutex_lock(job.mutex);
+      job.waiting = true;
+      while (!document.ready)
+        enif_cond_wait(job.cond, job.mutex);
+      job.waiting = false;
+      enif_mutex_unlock(job.mutex);
+    }
 
-      ERL_NIF_TERM v;
-      make_term_from_dom(env, value, &v);
-      keys[i] = k;
-      values[i] = v;
-      i++;
+    // Once a conversion has been stopped, the documents left fail with it.
+    int cancelled = job.cancelled.load(std::memory_order_relaxed);
+    if (failed)
+      results[i] = make_simdjson_error(env, simdjson::MEMALLOC);
+    else if (cancelled)
+      results[i] = make_term_error(env, term_error(cancelled));
+    else if (document.expired)
+      results[i] = make_term_error(env, TERM_DEADLINE);
+    else if (document.error)
+      results[i] = make_simdjson_error(env, document.error);
+    else {
+      uint64_t start = now_ns();
+      int convert_error =
+          convert_parallel_document(env, document, *job.options, env, caller,
+                                    job_start, &results[i]);
+      if (convert_error == TERM_DEADLINE || convert_error == TERM_CALLER_DOWN)
+        job.cancelled.store(convert_error, std::memory_order_relaxed);
+      convert_ns += now_ns() - start;
+      bytes += document.bin.size;
     }
-    enif_make_map_from_arrays(env, keys, values, obj.size(), term);
+    document.doc = simdjson::dom::document();
+    document.data.reset();
+    if (!failed) {
+      enif_mutex_lock(job.mutex);
+      job.converted = i + 1;
+      if (job.blocked)
+        enif_cond_broadcast(job.ahead_cond);
+      enif_mutex_unlock(job.mutex);
+    }
+  }
+  global_stats.convert_ns.fetch_add(convert_ns, std::memory_order_relaxed);
+  histogram_record(HISTOGRAM_CONVERT, bytes, convert_ns);
 
-  } break;
-  case simdjson::dom::element_type::ARRAY: {
-    ERL_NIF_TERM cons = enif_make_list(env, 0);
+  // The tasks use the job until the last of them has finished.
+  if (job.mutex) {
+    enif_mutex_lock(job.mutex);
+    job.waiting = true;
+    while (job.running)
+      enif_cond_wait(job.cond, job.mutex);
+    enif_mutex_unlock(job.mutex);
+    enif_mutex_destroy(job.mutex);
+  }
+  if (job.cond)
+    enif_cond_destroy(job.cond);
+  if (job.ahead_cond)
+    enif_cond_destroy(job.ahead_cond);
+
+  return enif_make_list_from_array(env, results.data(), job.count);
+}
 
-    simdjson::dom::array array = simdjson::dom::array(element);
+int convert_parallel_document(ErlNifEnv *env, parallel_document &document,
+                              const decode_options &options,
+                              ErlNifEnv *caller_env, const ErlNifPid &caller,
+                              uint64_t start, ERL_NIF_TERM *result) {
+  ERL_NIF_TERM term;
+  term_context ctx;
+  init_term_context(ctx, options, (const char *)document.bin.data,
+                    document.bin.size, document.big_integers,
+                    document.structurals.data(), document.structurals.size());
+  watch_conversion(ctx, caller_env, caller, start);
+  int convert_error = check_term_words(document.doc, ctx);
+  if (!convert_error)
+    convert_error = make_term_from_dom(env, document.doc.root(), &term, ctx);
+  if (convert_error)
+    *result = make_term_error(env, term_error(convert_error));
+  else
+    *result = make_ok_result(env, term);
 
-    for (size_t i = array.size(); i > 0; i--) {
-      simdjson::dom::element e = array.at(i - 1);
-      ERL_NIF_TERM car;
-      make_term_from_dom(env, e, &car);
-      cons = enif_make_list_cell(env, car, cons);
+  return convert_error;
+}
+
+ERL_NIF_TERM nif_parse_async(ErlNifEnv *env, const int argc,
+                             const ERL_NIF_TERM argv[]) {
+  if (argc != 2)
+    return enif_make_badarg(env);
+
+  ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
+  dom_parser_resource *res;
+  if (!enif_get_resource(env, argv[0], res_type, (void **)&res) ||
+      !enif_is_binary(env, argv[1]))
+    return enif_make_badarg(env);
+
+  async_parse *task = new async_parse();
+  task->task.run = run_async_parse;
+  task->env = enif_alloc_env();
+  if (!task->env) {
+    delete task;
+    return make_simdjson_error(env, simdjson::MEMALLOC);
+  }
+  enif_self(env, &task->caller);
+  task->start = now_ns();
+  task->res = res;
+  enif_keep_resource(res);
+  // Copying a large binary to the env only copies a reference to its data.
+  task->bin = enif_make_copy(task->env, argv[1]);
+  task->ref = enif_make_ref(task->env);
+  ERL_NIF_TERM ref = enif_make_copy(env, task->ref);
+  thread_pool_submit(&task->task);
+
+  return make_ok_result(env, ref);
+}
+
+void run_async_parse(pool_task *queued, size_t worker) {
+  // The document is parsed by the worker's own parser, as for
+  // parse_parallel, so that several parses of the same parser can run at
+  // once. The resource only gives its options and collects the stats.
+  async_parse *task = (async_parse *)queued;
+  dom_parser_resource *res = task->res;
+  ErlNifEnv *env = task->env;
+  bool owner_down = false;
+  if (res->mutex) {
+    enif_mutex_lock(res->mutex);
+    owner_down = res->owner_down;
+    enif_mutex_unlock(res->mutex);
+  }
+
+  // Nothing is done for a caller which has exited while the task was
+  // queued, or past its deadline.
+  bool caller_down = !enif_is_process_alive(nullptr, &task->caller);
+  uint64_t deadline = deadline_from(res->options, task->start);
+  ERL_NIF_TERM result;
+  parallel_document document;
+  enif_inspect_binary(env, task->bin, &document.bin);
+  if (caller_down)
+    result = 0;
+  else if (owner_down)
+    result = make_owner_down_error(env);
+  else if (deadline && now_ns() >= deadline)
+    result = make_term_error(env, TERM_DEADLINE);
+  else {
+    uint64_t start = now_ns();
+    document.error =
+        parse_parallel_document(pool_workers[worker], document, res->options);
+    uint64_t parse_ns = now_ns() - start;
+    size_t capacity = pool_workers[worker].parser.capacity();
+    stats_add_parse(res->stats, document.bin.size, document.error, capacity,
+                    parse_ns);
+    stats_add_parse(global_stats, document.bin.size, document.error, capacity,
+                    parse_ns);
+    histogram_record(HISTOGRAM_PARSE, document.bin.size, parse_ns);
+    account_worker_memory(pool_workers[worker]);
+
+    if (document.error)
+      result = make_simdjson_error(env, document.error);
+    else {
+      start = now_ns();
+      convert_parallel_document(env, document, res->options, nullptr,
+                                task->caller, task->start, &result);
+      record_convert(res, document.bin.size, now_ns() - start);
     }
-    *term = cons;
+  }
 
-  } break;
-  default:
-    break;
+  if (!caller_down) {
+    ERL_NIF_TERM msg =
+        enif_make_tuple3(env, atom_esimdjson, task->ref, result);
+    enif_send(nullptr, &task->caller, env, msg);
   }
+  enif_free_env(env);
+  enif_release_resource(res);
+  delete task;
+}
 
-  return 0;
+void run_parallel_task(pool_task *task, size_t worker) {
+  parallel_job &job = *((parallel_task *)task)->job;
+  for (size_t i; (i = job.next.fetch_add(1, std::memory_order_relaxed)) <
+                 job.count;) {
+    parallel_document &document = job.documents[i];
+    enif_mutex_lock(job.mutex);
+    while (i >= job.converted + job.ahead) {
+      job.blocked++;
+      enif_cond_wait(job.ahead_cond, job.mutex);
+      job.blocked--;
+    }
+    enif_mutex_unlock(job.mutex);
+
+    uint64_t start = now_ns();
+    if (job.cancelled.load(std::memory_order_relaxed) ||
+        (job.deadline && start >= job.deadline)) {
+      enif_mutex_lock(job.mutex);
+      document.expired = true;
+      document.ready = true;
+      if (job.waiting)
+        enif_cond_signal(job.cond);
+      enif_mutex_unlock(job.mutex);
+      continue;
+    }
+    bool is_file = !document.path.empty();
+    if (is_file) {
+      size_t len = 0;
+      document.error = read_file(document.path.c_str(), document.data,
+                                 document.data_capacity, &len);
+      document.bin.data = (unsigned char *)document.data.get();
+      document.bin.size = len;
+    }
+    if (!document.error)
+      document.error = parse_parallel_document(pool_workers[worker], document,
+                                               *job.options);
+    // The contents of a file are only needed after the parse for the text of
+    // numbers.
+    if (is_file && job.options->floats == FLOATS_FLOAT)
+      document.data.reset();
+    uint64_t parse_ns = now_ns() - start;
+    stats_add_parse(global_stats, document.bin.size, document.error,
+                    pool_workers[worker].parser.capacity(), parse_ns);
+    histogram_record(is_file ? HISTOGRAM_LOAD : HISTOGRAM_PARSE,
+                     document.bin.size, parse_ns);
+
+    enif_mutex_lock(job.mutex);
+    document.ready = true;
+    if (job.waiting)
+      enif_cond_signal(job.cond);
+    enif_mutex_unlock(job.mutex);
+  }
+  account_worker_memory(pool_workers[worker]);
+
+  enif_mutex_lock(job.mutex);
+  if (--job.running == 0 && job.waiting)
+    enif_cond_signal(job.cond);
+  enif_mutex_unlock(job.mutex);
 }
 
-void dom_parser_dtor(ErlNifEnv *env, void *obj) {
-  // Memory deallocation is done by Erlang GC since we released the resource
-  // with `enif_release_resource`, so we only need to do object destruction.
-  simdjson::dom::parser *pparser = (simdjson::dom::parser *)obj;
-  pparser->~parser();
+simdjson::error_code parse_parallel_document(pool_worker &worker,
+                                             parallel_document &document,
+                                             const decode_options &options) {
+  // Stage 1 runs in the worker's parser, on the file read or else on a
+  // padded copy of the binary. Stage 2 writes the tape to the document
+  // itself, so that it survives the worker's next document.
+  size_t len = document.bin.size;
+  auto error = reserve_worker(worker, len);
+  if (!error)
+    error = allocate_document(document.doc, len);
+  if (error)
+    return error;
+
+  char *buf = document.data.get();
+  if (!buf) {
+    buf = worker.buf.get();
+    std::memcpy(buf, document.bin.data, len);
+  }
+  auto &impl = *worker.parser.implementation;
+  if (options.big_integers)
+    error = parse_big_integers(impl, document.doc, buf, len,
+                               document.big_integers);
+  else {
+    error = impl.stage1((const uint8_t *)buf, len, false);
+    if (!error)
+      error = impl.stage2(document.doc);
+  }
+  if (!error && options.floats != FLOATS_FLOAT)
+    document.structurals.assign(impl.structural_indexes.get(),
+                                impl.structural_indexes.get() +
+                                    impl.n_structural_indexes);
+
+  return error;
+}
+
+simdjson::error_code reserve_worker(pool_worker &worker, size_t size) {
+  // The worker's parser only keeps the buffers of stage 1, its own document
+  // is never allocated.
+  simdjson::dom::parser &parser = worker.parser;
+  if (!parser.implementation || parser.implementation->capacity() < size) {
+    if (size > parser.max_capacity())
+      return simdjson::CAPACITY;
+    auto error =
+        parser.implementation
+            ? parser.implementation->allocate(size, parser.max_depth())
+            : simdjson::active_implementation->create_dom_parser_implementation(
+                  size, parser.max_depth(), parser.implementation);
+    if (error)
+      return error;
+  }
+
+  return reserve_buf(worker.buf, worker.buf_capacity, size);
+}
+
+simdjson::error_code allocate_document(simdjson::dom::document &doc,
+                                       size_t capacity) {
+  // Same sizes as dom::document::allocate, which is private.
+  size_t tape_capacity = SIMDJSON_ROUNDUP_N(capacity + 3, 64);
+  size_t string_capacity =
+      SIMDJSON_ROUNDUP_N(5 * capacity / 3 + simdjson::SIMDJSON_PADDING, 64);
+  doc.tape.reset(new (std::nothrow) uint64_t[tape_capacity]);
+  doc.string_buf.reset(new (std::nothrow) uint8_t[string_capacity]);
+
+  return doc.tape && doc.string_buf ? simdjson::SUCCESS : simdjson::MEMALLOC;
+}
+
+void account_worker_memory(pool_worker &worker) {
+  const simdjson::dom::parser &parser = worker.parser;
+  size_t total = 0;
+  if (parser.implementation) {
+    size_t capacity = parser.implementation->capacity();
+    total += (SIMDJSON_ROUNDUP_N(capacity, 64) + 2 + 7) * sizeof(uint32_t) +
+             parser.max_depth() * (2 * sizeof(uint32_t) + 1);
+  }
+  if (worker.buf)
+    total += worker.buf_capacity + simdjson::SIMDJSON_PADDING;
+
+  memory_held.fetch_add(total - worker.accounted_memory,
+                        std::memory_order_relaxed);
+  worker.accounted_memory = total;
+}
+
+ERL_NIF_TERM load_document(ErlNifEnv *env, dom_parser_resource *res,
+                           size_t len, uint64_t start,
+                           const decode_options &options) {
+  simdjson::dom::element element;
+  big_integer_table big_integers;
+  simdjson::error_code error;
+
+  // The load histogram covers the read as well, from `start` on.
+  if (options.big_integers)
+    error = parse_big_integers(res, res->load_buf.get(), len, big_integers)
+                .get(element);
+  else
+    error = res->parser.parse(res->load_buf.get(), len, false).get(element);
+  record_parse(res, HISTOGRAM_LOAD, len, error, now_ns() - start);
+  if (error) {
+    track_document(res, len);
+    return make_simdjson_error(env, error);
+  }
+
+  uint64_t convert_start = now_ns();
+  ERL_NIF_TERM result;
+  term_context ctx;
+  const auto &impl = res->parser.implementation;
+  init_term_context(ctx, options, res->load_buf.get(), len, big_integers,
+                    impl->structural_indexes.get(), impl->n_structural_indexes);
+  ErlNifPid caller;
+  watch_conversion(ctx, env, *enif_self(env, &caller), start);
+  int convert_error = check_term_words(res->parser.doc, ctx);
+  if (!convert_error)
+    convert_error = make_term_from_dom(env, element, &result, ctx);
+  record_convert(res, len, now_ns() - convert_start);
+  track_document(res, len);
+  if (convert_error)
+    return make_term_error(env, term_error(convert_error));
+
+  return make_ok_result(env, result);
+}
+
+ERL_NIF_TERM parse_document(ErlNifEnv *env, dom_parser_resource *res,
+                            const ErlNifBinary &bin,
+                            const decode_options &options) {
+  // A hit is copied from the cache without parsing.
+  uint64_t hash = 0;
+  if (options.cache) {
+    hash = content_hash(bin.data, bin.size, options_hash(options));
+    auto entry = result_cache_lookup(options.cache, hash, bin, options);
+    if (entry)
+      return cached_result(env, *entry, options);
+  }
+
+  uint64_t start = now_ns();
+  simdjson::dom::element element;
+  big_integer_table big_integers;
+  auto error = parse_binary(res, bin, options, big_integers, &element);
+  record_parse(res, HISTOGRAM_PARSE, bin.size, error, now_ns() - start);
+  if (error) {
+    track_document(res, bin.size);
+    return make_simdjson_error(env, error);
+  }
+
+  uint64_t convert_start = now_ns();
+  ERL_NIF_TERM result;
+  term_context ctx;
+  const auto &impl = res->parser.implementation;
+  init_term_context(ctx, options, (const char *)bin.data, bin.size,
+                    big_integers, impl->structural_indexes.get(),
+                    impl->n_structural_indexes);
+  ErlNifPid caller;
+  watch_conversion(ctx, env, *enif_self(env, &caller), start);
+  size_t words = 0;
+  size_t binary_bytes = 0;
+  int convert_error =
+      check_term_words(res->parser.doc, ctx,
+                       options.cache ? &words : nullptr, &binary_bytes);
+  if (!convert_error)
+    convert_error = make_term_from_dom(env, element, &result, ctx);
+  record_convert(res, bin.size, now_ns() - convert_start);
+  track_document(res, bin.size);
+  if (convert_error)
+    return make_term_error(env, term_error(convert_error));
+
+  if (options.cache)
+    cache_result(options.cache, hash, bin, result, options, words,
+                 binary_bytes);
+  return make_ok_result(env, result);
+}
+
+uint64_t options_hash(const decode_options &options) {
+  // The options which change the term, as compared by the cache.
+  uint64_t h = options.big_integers | options.floats << 1 |
+               options.objects << 3 | options.duplicate_keys << 5;
+  for (ERL_NIF_TERM term :
+       {options.null_term, options.true_term, options.false_term})
+    h = h * 0x100000001b3 +
+        (term ? enif_hash(ERL_NIF_INTERNAL_HASH, term, 0) : 0);
+
+  return h;
+}
+
+ERL_NIF_TERM cached_result(ErlNifEnv *env, const cache_entry &entry,
+                           const decode_options &options) {
+  if (options.max_term_words && entry.words > options.max_term_words)
+    return make_term_error(env, TERM_TOO_LARGE);
+
+  return make_ok_result(env, enif_make_copy(env, entry.term));
+}
+
+void cache_result(result_cache *cache, uint64_t hash, const ErlNifBinary &bin,
+                  ERL_NIF_TERM term, const decode_options &options,
+                  size_t words, size_t binary_bytes) {
+  // The entry keeps a copy of the input to compare with, and charges the
+  // cache for it and for the estimated size of the term, including the
+  // strings too large for its heap.
+  auto entry = std::make_shared<cache_entry>();
+  entry->env = enif_alloc_env();
+  if (!entry->env)
+    return;
+  entry->hash = hash;
+  entry->options = options;
+  if (keep_literal_terms(entry->env, &entry->options, &entry->env))
+    return;
+  ERL_NIF_TERM input;
+  unsigned char *data = enif_make_new_binary(entry->env, bin.size, &input);
+  if (!data)
+    return;
+  std::memcpy(data, bin.data, bin.size);
+  enif_inspect_binary(entry->env, input, &entry->input);
+  entry->term = enif_make_copy(entry->env, term);
+  entry->words = words;
+  entry->memory = sizeof(cache_entry) + bin.size +
+                  words * sizeof(ERL_NIF_TERM) + binary_bytes;
+  result_cache_insert(cache, std::move(entry));
+}
+
+simdjson::error_code parse_binary(dom_parser_resource *res,
+                                  const ErlNifBinary &bin,
+                                  const decode_options &options,
+                                  big_integer_table &big_integers,
+                                  simdjson::dom::element *element) {
+  if (!options.big_integers)
+    return res->parser.parse((char *)bin.data, bin.size).get(*element);
+
+  // Oversized integers are blanked out of the document before stage 2, so
+  // it is parsed from a copy.
+  auto error = reserve_buf(res->load_buf, res->load_buf_capacity, bin.size);
+  res->load_buf_generation++;
+  if (error)
+    return error;
+  std::memcpy(res->load_buf.get(), bin.data, bin.size);
+  return parse_big_integers(res, res->load_buf.get(), bin.size, big_integers)
+      .get(*element);
+}
+
+ERL_NIF_TERM nif_estimate(ErlNifEnv *env, const int argc,
+                          const ERL_NIF_TERM argv[]) {
+  if (argc != 2)
+    return enif_make_badarg(env);
+
+  ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
+  dom_parser_resource *res;
+  ErlNifBinary bin;
+  if (!enif_get_resource(env, argv[0], res_type, (void **)&res) ||
+      !enif_inspect_binary(env, argv[1], &bin))
+    return enif_make_badarg(env);
+
+  if (!enter_parser(res))
+    return make_owner_down_error(env);
+  uint64_t start = now_ns();
+  simdjson::dom::element element;
+  big_integer_table big_integers;
+  auto error = parse_binary(res, bin, res->options, big_integers, &element);
+  record_parse(res, HISTOGRAM_PARSE, bin.size, error, now_ns() - start);
+  ERL_NIF_TERM result;
+  if (error)
+    result = make_simdjson_error(env, error);
+  else {
+    term_context ctx;
+    const auto &impl = res->parser.implementation;
+    init_term_context(ctx, res->options, (const char *)bin.data, bin.size,
+                      big_integers, impl->structural_indexes.get(),
+                      impl->n_structural_indexes);
+    size_t words = estimate_term_words(res->parser.doc, ctx);
+    result = make_ok_result(env, enif_make_uint64(env, words));
+  }
+  track_document(res, bin.size);
+  leave_parser(res);
+
+  return result;
+}
+
+ERL_NIF_TERM nif_decode_profile(ErlNifEnv *env, const int argc,
+                                const ERL_NIF_TERM argv[]) {
+  ERL_NIF_TERM opt_cdr;
+  ERL_NIF_TERM opt_car;
+  decode_options options;
+
+  if (argc != 1 || !enif_is_list(env, (opt_cdr = argv[0])))
+    return enif_make_badarg(env);
+
+  while (enif_get_list_cell(env, opt_cdr, &opt_car, &opt_cdr)) {
+    if (!get_decode_option(env, opt_car, &options))
+      return enif_make_badarg(env);
+  }
+
+  void *profile_res =
+      enif_alloc_resource(decode_profile_type, sizeof(decode_profile_resource));
+  decode_profile_resource *profile =
+      new (profile_res) decode_profile_resource();
+  profile->options = options;
+  ERL_NIF_TERM profile_term = enif_make_resource(env, profile_res);
+  enif_release_resource(profile_res);
+  if (keep_literal_terms(env, &profile->options,
+                         &profile->terms_env))
+    return make_simdjson_error(env, simdjson::MEMALLOC);
+
+  return make_ok_result(env, profile_term);
+}
+
+ERL_NIF_TERM nif_max_capacity(ErlNifEnv *env, const int argc,
+                              const ERL_NIF_TERM argv[]) {
+  if (argc != 1)
+    return enif_make_badarg(env);
+
+  ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
+  dom_parser_resource *res;
+  if (!enif_get_resource(env, argv[0], res_type, (void **)&res))
+    return enif_make_badarg(env);
+
+  ERL_NIF_TERM result = enif_make_uint64(env, res->parser.max_capacity());
+
+  return make_ok_result(env, result);
+}
+
+ERL_NIF_TERM nif_trim(ErlNifEnv *env, const int argc,
+                      const ERL_NIF_TERM argv[]) {
+  if (argc != 1)
+    return enif_make_badarg(env);
+
+  ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
+  dom_parser_resource *res;
+  if (!enif_get_resource(env, argv[0], res_type, (void **)&res))
+    return enif_make_badarg(env);
+
+  if (!enter_parser(res))
+    return make_owner_down_error(env);
+  auto error = trim_parser(res, 1);
+  account_memory(res);
+  size_t capacity = res->parser.capacity();
+  leave_parser(res);
+  if (error)
+    return make_simdjson_error(env, error);
+
+  return make_ok_result(env, enif_make_uint64(env, capacity));
+}
+
+ERL_NIF_TERM nif_memory(ErlNifEnv *env, const int argc,
+                        const ERL_NIF_TERM argv[]) {
+  if (argc == 0)
+    return make_ok_result(
+        env, enif_make_uint64(env, memory_held.load(std::memory_order_relaxed) +
+                                       document_store_memory()));
+
+  if (argc != 1)
+    return enif_make_badarg(env);
+
+  ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
+  dom_parser_resource *res;
+  if (!enif_get_resource(env, argv[0], res_type, (void **)&res))
+    return enif_make_badarg(env);
+
+  parser_memory mem = get_parser_memory(res);
+  ERL_NIF_TERM keys[] = {
+      make_atom(env, "total"),        make_atom(env, "tape"),
+      make_atom(env, "string_buf"),   make_atom(env, "structural_indexes"),
+      make_atom(env, "depth_stacks"), make_atom(env, "load_buf"),
+  };
+  ERL_NIF_TERM values[] = {
+      enif_make_uint64(env, mem.total),
+      enif_make_uint64(env, mem.tape),
+      enif_make_uint64(env, mem.string_buf),
+      enif_make_uint64(env, mem.structural_indexes),
+      enif_make_uint64(env, mem.depth_stacks),
+      enif_make_uint64(env, mem.load_buf),
+  };
+  ERL_NIF_TERM map;
+  enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(*keys),
+                            &map);
+
+  return make_ok_result(env, map);
+}
+
+ERL_NIF_TERM nif_pending_frees(ErlNifEnv *env, const int argc,
+                               const ERL_NIF_TERM argv[]) {
+  if (argc != 0)
+    return enif_make_badarg(env);
+
+  return make_ok_result(
+      env, enif_make_uint64(env, pending_frees.load(std::memory_order_relaxed)));
+}
+
+ERL_NIF_TERM nif_stats(ErlNifEnv *env, const int argc,
+                       const ERL_NIF_TERM argv[]) {
+  if (argc == 0)
+    return make_ok_result(env, make_stats(env, global_stats));
+
+  if (argc != 1)
+    return enif_make_badarg(env);
+
+  ErlNifResourceType *res_type = (ErlNifResourceType *)enif_priv_data(env);
+  dom_parser_resource *res;
+  if (!enif_get_resource(env, argv[0], res_type, (void **)&res))
+    return enif_make_badarg(env);
+
+  return make_ok_result(env, make_stats(env, res->stats));
+}
+
+ERL_NIF_TERM nif_new_cache(ErlNifEnv *env, const int argc,
+                           const ERL_NIF_TERM argv[]) {
+  ERL_NIF_TERM opt_cdr;
+  ERL_NIF_TERM opt_car;
+  size_t max_memory = CACHE_DEFAULT_MAX_MEMORY;
+  if (argc != 2 || !enif_is_atom(env, argv[0]) ||
+      !enif_is_list(env, (opt_cdr = argv[1])))
+    return enif_make_badarg(env);
+
+  while (enif_get_list_cell(env, opt_cdr, &opt_car, &opt_cdr)) {
+    if (!get_max_memory(env, opt_car, &max_memory))
+      return enif_make_badarg(env);
+  }
+
+  if (!result_cache_open(argv[0], max_memory))
+    return make_simdjson_error(env, simdjson::MEMALLOC);
+
+  return atom_ok;
+}
+
+ERL_NIF_TERM nif_cache_stats(ErlNifEnv *env, const int argc,
+                             const ERL_NIF_TERM argv[]) {
+  if (argc != 1 || !enif_is_atom(env, argv[0]))
+    return enif_make_badarg(env);
+  result_cache *cache = result_cache_find(argv[0]);
+  if (!cache)
+    return make_error(env, atom_not_found);
+
+  cache_stats stats = result_cache_stats(cache);
+  ERL_NIF_TERM keys[] = {
+      make_atom(env, "hits"),      make_atom(env, "misses"),
+      make_atom(env, "evictions"), make_atom(env, "entries"),
+      make_atom(env, "memory"),    make_atom(env, "max_memory"),
+  };
+  ERL_NIF_TERM values[] = {
+      enif_make_uint64(env, stats.hits),
+      enif_make_uint64(env, stats.misses),
+      enif_make_uint64(env, stats.evictions),
+      enif_make_uint64(env, stats.entries),
+      enif_make_uint64(env, stats.memory),
+      enif_make_uint64(env, stats.max_memory),
+  };
+  ERL_NIF_TERM map;
+  enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(*keys),
+                            &map);
+
+  return make_ok_result(env, map);
+}
+
+ERL_NIF_TERM nif_publish(ErlNifEnv *env, const int argc,
+                         const ERL_NIF_TERM argv[]) {
+  ErlNifBinary bin;
+  if ((argc != 2 && argc != 3) || !enif_is_atom(env, argv[0]) ||
+      !enif_inspect_binary(env, argv[1], &bin))
+    return enif_make_badarg(env);
+
+  ERL_NIF_TERM opt_cdr = argc == 3 ? argv[2] : enif_make_list(env, 0);
+  ERL_NIF_TERM opt_car;
+  uint64_t index_after = INDEX_DEFAULT_AFTER;
+  size_t max_index_memory = SIZE_MAX;
+  if (!enif_is_list(env, opt_cdr))
+    return enif_make_badarg(env);
+  while (enif_get_list_cell(env, opt_cdr, &opt_car, &opt_cdr)) {
+    if (get_index_after(env, opt_car, &index_after))
+      continue;
+    else if (get_max_index_memory(env, opt_car, &max_index_memory))
+      continue;
+    else
+      return enif_make_badarg(env);
+  }
+
+  // A parser of its own, whose document is moved out of it once parsed and
+  // the rest freed, so that the store only keeps the tape and the strings.
+  uint64_t start = now_ns();
+  simdjson::dom::parser parser;
+  auto error = parser.parse(bin.data, bin.size).error();
+  uint64_t parse_ns = now_ns() - start;
+  size_t capacity = parser.capacity();
+  stats_add_parse(global_stats, bin.size, error, capacity, parse_ns);
+  histogram_record(HISTOGRAM_PARSE, bin.size, parse_ns);
+  if (error)
+    return make_simdjson_error(env, error);
+
+  // Sized from the capacity as in get_parser_memory.
+  size_t memory =
+      sizeof(stored_document) +
+      SIMDJSON_ROUNDUP_N(capacity + 3, 64) * sizeof(uint64_t) +
+      SIMDJSON_ROUNDUP_N(5 * capacity / 3 + simdjson::SIMDJSON_PADDING, 64);
+  auto stored = std::make_shared<stored_document>(std::move(parser.doc),
+                                                  bin.size, memory);
+  if (!stored->index_lock)
+    return make_simdjson_error(env, simdjson::MEMALLOC);
+  // Unless capped, the indexes may take as much memory as the document.
+  stored->index_after = index_after;
+  stored->max_index_memory =
+      max_index_memory == SIZE_MAX ? memory : max_index_memory;
+  document_store_publish(argv[0], std::move(stored));
+
+  return atom_ok;
+}
+
+ERL_NIF_TERM nif_lookup(ErlNifEnv *env, const int argc,
+                        const ERL_NIF_TERM argv[]) {
+  ErlNifBinary pointer;
+  if ((argc != 2 && argc != 3) || !enif_is_atom(env, argv[0]) ||
+      !enif_inspect_binary(env, argv[1], &pointer))
+    return enif_make_badarg(env);
+
+  // Numbers are only kept on the tape, so a profile wanting their text is
+  // refused.
+  decode_options default_options;
+  const decode_options *options = &default_options;
+  if (argc == 3 && (!get_profile(env, argv[2], &options) ||
+                    options->floats != FLOATS_FLOAT))
+    return enif_make_badarg(env);
+
+  // The reference keeps the document alive through the conversion, even if
+  // it is replaced or unpublished meanwhile.
+  std::shared_ptr<stored_document> stored = document_store_find(argv[0]);
+  if (!stored)
+    return make_error(env, atom_not_found);
+
+  // Most lookups fetch a small value through indexed objects, and are done
+  // on the calling scheduler. Those which would scan or index a wide object,
+  // or convert a large value, are called again with the same arguments on a
+  // dirty scheduler, where the pointer is resolved in the document published
+  // by then.
+  bool dirty = enif_thread_type() == ERL_NIF_THR_DIRTY_CPU_SCHEDULER;
+  bool deferred = false;
+  uint64_t start = now_ns();
+  simdjson::dom::element element;
+  auto error = document_store_at_pointer(
+      *stored, std::string_view((const char *)pointer.data, pointer.size),
+      &element, dirty ? nullptr : &deferred);
+  ERL_NIF_TERM result;
+  if (error)
+    result = make_simdjson_error(env, error);
+  else if (!dirty && (deferred || estimate_element_words(
+                                      element, options->objects,
+                                      LOOKUP_MAX_INLINE_WORDS) >
+                                      LOOKUP_MAX_INLINE_WORDS))
+    result = enif_schedule_nif(env, "lookup", ERL_NIF_DIRTY_JOB_CPU_BOUND,
+                               nif_lookup, argc, argv);
+  else {
+    term_context ctx;
+    ctx.options = *options;
+    ErlNifPid caller;
+    watch_conversion(ctx, env, *enif_self(env, &caller), start);
+    int convert_error = make_term_from_dom(env, element, &result, ctx);
+    global_stats.convert_ns.fetch_add(now_ns() - start,
+                                      std::memory_order_relaxed);
+    result = convert_error ? make_term_error(env, term_error(convert_error))
+                           : make_ok_result(env, result);
+  }
+  // A document replaced or unpublished meanwhile is freed with this
+  // reference.
+  release_document(std::move(stored));
+
+  return result;
+}
+
+ERL_NIF_TERM nif_unpublish(ErlNifEnv *env, const int argc,
+                           const ERL_NIF_TERM argv[]) {
+  if (argc != 1 || !enif_is_atom(env, argv[0]))
+    return enif_make_badarg(env);
+
+  std::shared_ptr<stored_document> stored = document_store_remove(argv[0]);
+  if (!stored)
+    return make_error(env, atom_not_found);
+  release_document(std::move(stored));
+
+  return atom_ok;
+}
+
+ERL_NIF_TERM nif_document_stats(ErlNifEnv *env, const int argc,
+                                const ERL_NIF_TERM argv[]) {
+  if (argc != 1 || !enif_is_atom(env, argv[0]))
+    return enif_make_badarg(env);
+  std::shared_ptr<stored_document> stored = document_store_find(argv[0]);
+  if (!stored)
+    return make_error(env, atom_not_found);
+
+  ERL_NIF_TERM keys[] = {
+      make_atom(env, "size"),
+      make_atom(env, "memory"),
+      make_atom(env, "index_memory"),
+      make_atom(env, "max_index_memory"),
+      make_atom(env, "indexed_objects"),
+  };
+  ERL_NIF_TERM values[] = {
+      enif_make_uint64(env, stored->size),
+      enif_make_uint64(env, stored->memory),
+      enif_make_uint64(
+          env, stored->index_memory.load(std::memory_order_relaxed)),
+      enif_make_uint64(env, stored->max_index_memory),
+      enif_make_uint64(
+          env, stored->indexed_objects.load(std::memory_order_relaxed)),
+  };
+  ERL_NIF_TERM map;
+  enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(*keys),
+                            &map);
+  // A document replaced since it was found is freed with this reference.
+  release_document(std::move(stored));
+
+  return make_ok_result(env, map);
+}
+
+ERL_NIF_TERM nif_histograms(ErlNifEnv *env, const int argc,
+                            const ERL_NIF_TERM argv[]) {
+  if (argc != 0)
+    return enif_make_badarg(env);
+
+  ERL_NIF_TERM keys[] = {make_atom(env, "parse"), make_atom(env, "load"),
+                         make_atom(env, "convert")};
+  ERL_NIF_TERM values[] = {make_histogram(env, HISTOGRAM_PARSE),
+                           make_histogram(env, HISTOGRAM_LOAD),
+                           make_histogram(env, HISTOGRAM_CONVERT)};
+  ERL_NIF_TERM map;
+  enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(*keys),
+                            &map);
+
+  return make_ok_result(env, map);
+}
+
+ERL_NIF_TERM nif_implementations(ErlNifEnv *env, const int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  if (argc != 0)
+    return enif_make_badarg(env);
+
+  ERL_NIF_TERM keys[] = {make_atom(env, "name"), make_atom(env, "description"),
+                         make_atom(env, "supported")};
+  ERL_NIF_TERM list = enif_make_list(env, 0);
+  auto &impls = simdjson::available_implementations;
+  for (auto it = impls.end(); it != impls.begin(); it--) {
+    const simdjson::implementation *impl = *(it - 1);
+    ERL_NIF_TERM values[] = {
+        make_atom(env, impl->name().c_str()),
+        enif_make_string(env, impl->description().c_str(), ERL_NIF_LATIN1),
+        impl->supported_by_runtime_system() ? atom_true : atom_false};
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(*keys),
+                              &map);
+    list = enif_make_list_cell(env, map, list);
+  }
+
+  return make_ok_result(env, list);
+}
+
+ERL_NIF_TERM nif_active_implementation(ErlNifEnv *env, const int argc,
+                                       const ERL_NIF_TERM argv[]) {
+  if (argc != 0)
+    return enif_make_badarg(env);
+
+  // Dereferencing the active implementation runs simdjson's detection of the
+  // best implementation, if that has not happened yet.
+  const simdjson::implementation *impl = simdjson::active_implementation;
+  return make_ok_result(env, make_atom(env, impl->name().c_str()));
+}
+
+int get_max_capacity(ErlNifEnv *env, const ERL_NIF_TERM opt, size_t *max_cap) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_max_capacity) &&
+      enif_get_uint64(env, tuple_array[1], max_cap))
+    ret = 1;
+
+  return ret;
+}
+
+int get_fixed_capacity(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                       size_t *fixed_cap) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_fixed_capacity) &&
+      enif_get_uint64(env, tuple_array[1], fixed_cap))
+    ret = 1;
+
+  return ret;
+}
+
+int get_max_depth(ErlNifEnv *env, const ERL_NIF_TERM opt, size_t *max_depth) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_max_depth) &&
+      enif_get_uint64(env, tuple_array[1], max_depth) && *max_depth > 0)
+    ret = 1;
+
+  return ret;
+}
+
+int get_shrink_after(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                     size_t *shrink_after) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_shrink_after) &&
+      enif_get_uint64(env, tuple_array[1], shrink_after) && *shrink_after > 0)
+    ret = 1;
+
+  return ret;
+}
+
+int get_decode_option(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                      decode_options *options) {
+  return get_big_integers(env, opt, &options->big_integers) ||
+         get_floats(env, opt, &options->floats) ||
+         get_objects(env, opt, &options->objects) ||
+         get_duplicate_keys(env, opt, &options->duplicate_keys) ||
+         get_literal_term(env, opt, options) ||
+         get_deadline_ms(env, opt, &options->deadline_ms) ||
+         get_max_term_words(env, opt, &options->max_term_words) ||
+         get_cache(env, opt, &options->cache);
+}
+
+int get_literal_term(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                     decode_options *options) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2) {
+    ret = 1;
+    if (enif_is_identical(tuple_array[0], atom_null_term))
+      options->null_term = tuple_array[1];
+    else if (enif_is_identical(tuple_array[0], atom_true_term))
+      options->true_term = tuple_array[1];
+    else if (enif_is_identical(tuple_array[0], atom_false_term))
+      options->false_term = tuple_array[1];
+    else
+      ret = 0;
+  }
+
+  return ret;
+}
+
+int keep_literal_terms(ErlNifEnv *env, decode_options *options,
+                       ErlNifEnv **terms_env) {
+  // The options were read from the env of the calling NIF. Atoms outlive it,
+  // other terms are copied to an env of their own.
+  for (ERL_NIF_TERM *term :
+       {&options->null_term, &options->true_term, &options->false_term}) {
+    if (!*term || enif_is_atom(env, *term))
+      continue;
+    if (!*terms_env && !(*terms_env = enif_alloc_env()))
+      return -1;
+    *term = enif_make_copy(*terms_env, *term);
+  }
+
+  return 0;
+}
+
+ERL_NIF_TERM literal_term(ErlNifEnv *env, const ERL_NIF_TERM term,
+                          const ERL_NIF_TERM default_term) {
+  if (!term)
+    return default_term;
+  if (enif_is_atom(env, term))
+    return term;
+  return enif_make_copy(env, term);
+}
+
+int get_profile(ErlNifEnv *env, const ERL_NIF_TERM arg,
+                const decode_options **options) {
+  decode_profile_resource *profile;
+  if (!enif_get_resource(env, arg, decode_profile_type, (void **)&profile))
+    return 0;
+
+  *options = &profile->options;
+  return 1;
+}
+
+int get_big_integers(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                     bool *big_integers) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_big_integers)) {
+    if (enif_is_identical(tuple_array[1], atom_true)) {
+      *big_integers = true;
+      ret = 1;
+    } else if (enif_is_identical(tuple_array[1], atom_false)) {
+      *big_integers = false;
+      ret = 1;
+    }
+  }
+
+  return ret;
+}
+
+int get_floats(ErlNifEnv *env, const ERL_NIF_TERM opt, float_format *floats) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_floats)) {
+    ret = 1;
+    if (enif_is_identical(tuple_array[1], atom_float))
+      *floats = FLOATS_FLOAT;
+    else if (enif_is_identical(tuple_array[1], atom_decimal))
+      *floats = FLOATS_DECIMAL;
+    else if (enif_is_identical(tuple_array[1], atom_binary))
+      *floats = FLOATS_BINARY;
+    else
+      ret = 0;
+  }
+
+  return ret;
+}
+
+int get_objects(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                object_format *objects) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_objects)) {
+    ret = 1;
+    if (enif_is_identical(tuple_array[1], atom_map))
+      *objects = OBJECTS_MAP;
+    else if (enif_is_identical(tuple_array[1], atom_proplist))
+      *objects = OBJECTS_PROPLIST;
+    else if (enif_is_identical(tuple_array[1], atom_tuple_list))
+      *objects = OBJECTS_TUPLE_LIST;
+    else
+      ret = 0;
+  }
+
+  return ret;
+}
+
+int get_duplicate_keys(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                       duplicate_keys_policy *duplicate_keys) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_duplicate_keys)) {
+    ret = 1;
+    if (enif_is_identical(tuple_array[1], atom_last))
+      *duplicate_keys = DUPLICATE_KEYS_LAST;
+    else if (enif_is_identical(tuple_array[1], atom_first))
+      *duplicate_keys = DUPLICATE_KEYS_FIRST;
+    else if (enif_is_identical(tuple_array[1], atom_error))
+      *duplicate_keys = DUPLICATE_KEYS_ERROR;
+    else
+      ret = 0;
+  }
+
+  return ret;
+}
+
+int get_owner(ErlNifEnv *env, const ERL_NIF_TERM opt, ErlNifPid *owner) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_owner) &&
+      enif_get_local_pid(env, tuple_array[1], owner))
+    ret = 1;
+
+  return ret;
+}
+
+int get_deadline_ms(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                    uint64_t *deadline_ms) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_deadline_ms) &&
+      enif_get_uint64(env, tuple_array[1], deadline_ms) && *deadline_ms > 0)
+    ret = 1;
+
+  return ret;
+}
+
+int get_max_term_words(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                       size_t *max_term_words) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_max_term_words) &&
+      enif_get_uint64(env, tuple_array[1], max_term_words) &&
+      *max_term_words > 0)
+    ret = 1;
+
+  return ret;
+}
+
+int get_cache(ErlNifEnv *env, const ERL_NIF_TERM opt, result_cache **cache) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_cache) &&
+      (*cache = result_cache_find(tuple_array[1])))
+    ret = 1;
+
+  return ret;
+}
+
+int get_max_memory(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                   size_t *max_memory) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_max_memory) &&
+      enif_get_uint64(env, tuple_array[1], max_memory))
+    ret = 1;
+
+  return ret;
+}
+
+int get_index_after(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                    uint64_t *index_after) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_index_after) &&
+      enif_get_uint64(env, tuple_array[1], index_after))
+    ret = 1;
+
+  return ret;
+}
+
+int get_max_index_memory(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                         size_t *max_index_memory) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_max_index_memory) &&
+      enif_get_uint64(env, tuple_array[1], max_index_memory))
+    ret = 1;
+
+  return ret;
+}
+
+int get_pool_workers(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                     size_t *workers) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_pool_workers) &&
+      enif_get_uint64(env, tuple_array[1], workers) && *workers > 0)
+    ret = 1;
+
+  return ret;
+}
+
+int get_async_free_threshold(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                             size_t *threshold) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_async_free_threshold) &&
+      enif_get_uint64(env, tuple_array[1], threshold))
+    ret = 1;
+
+  return ret;
+}
+
+int get_implementation(ErlNifEnv *env, const ERL_NIF_TERM opt,
+                       const simdjson::implementation **impl) {
+  int arity = 0;
+  int ret = 0;
+  const ERL_NIF_TERM *tuple_array;
+  if (enif_get_tuple(env, opt, &arity, &tuple_array) && arity == 2 &&
+      enif_is_identical(tuple_array[0], atom_implementation) &&
+      (*impl = find_implementation(env, tuple_array[1])))
+    ret = 1;
+
+  return ret;
+}
+
+const simdjson::implementation *find_implementation(ErlNifEnv *env,
+                                                    const ERL_NIF_TERM name) {
+  char name_str[64];
+  if (!enif_get_atom(env, name, name_str, sizeof(name_str), ERL_NIF_LATIN1))
+    return nullptr;
+
+  return simdjson::available_implementations[name_str];
+}
+
+int make_term_from_dom(ErlNifEnv *env, const simdjson::dom::element element,
+                       ERL_NIF_TERM *term) {
+  term_context ctx;
+  return make_term_from_dom(env, element, term, ctx);
+}
+
+int make_term_from_dom(ErlNifEnv *env, const simdjson::dom::element element,
+                       ERL_NIF_TERM *term, term_context &ctx) {
+  // Terms other than atoms are copied to the env once per document, and
+  // then shared by every null, true or false of the document.
+  ctx.null_term = literal_term(env, ctx.options.null_term, atom_null);
+  ctx.true_term = literal_term(env, ctx.options.true_term, atom_true);
+  ctx.false_term = literal_term(env, ctx.options.false_term, atom_false);
+
+  // The conversion is instantiated for every combination of the formats, so
+  // that they are not tested again for every value of the document.
+  using make_term_fun = int (*)(ErlNifEnv *, const simdjson::dom::element,
+                                ERL_NIF_TERM *, term_context &);
+  static const make_term_fun funs[3][3] = {
+      {make_term<FLOATS_FLOAT, OBJECTS_MAP>,
+       make_term<FLOATS_FLOAT, OBJECTS_PROPLIST>,
+       make_term<FLOATS_FLOAT, OBJECTS_TUPLE_LIST>},
+      {make_term<FLOATS_DECIMAL, OBJECTS_MAP>,
+       make_term<FLOATS_DECIMAL, OBJECTS_PROPLIST>,
+       make_term<FLOATS_DECIMAL, OBJECTS_TUPLE_LIST>},
+      {make_term<FLOATS_BINARY, OBJECTS_MAP>,
+       make_term<FLOATS_BINARY, OBJECTS_PROPLIST>,
+       make_term<FLOATS_BINARY, OBJECTS_TUPLE_LIST>}};
+
+  return funs[ctx.options.floats][ctx.options.objects](env, element, term,
+                                                        ctx);
+}
+
+template <float_format Floats, object_format Objects>
+int make_term(ErlNifEnv *env, const simdjson::dom::element element,
+              ERL_NIF_TERM *term, term_context &ctx) {
+  if (--ctx.until_check == 0) {
+    int error = check_cancelled(ctx);
+    if (error)
+      return error;
+  }
+
+  switch (element.type()) {
+  case simdjson::dom::element_type::INT64:
+    // Oversized integers were replaced by a 0 in the document, and are
+    // recognised by their position among the numbers.
+    if (ctx.source)
+      next_number(ctx);
+    if (ctx.big_integers && next_is_big_integer(ctx)) {
+      const big_integer &integer =
+          ctx.big_integers->integers[ctx.next_big_integer++];
+      *term = make_big_integer(
+          env, ctx.big_integers->digits.data() + integer.offset,
+          integer.length, integer.negative);
+    } else
+      *term = enif_make_int64(env, int64_t(element));
+    break;
+  case simdjson::dom::element_type::UINT64:
+    if (ctx.source)
+      next_number(ctx);
+    ctx.numbers += ctx.big_integers != nullptr;
+    *term = enif_make_uint64(env, uint64_t(element));
+    break;
+  case simdjson::dom::element_type::DOUBLE:
+    ctx.numbers += ctx.big_integers != nullptr;
+    if (Floats == FLOATS_FLOAT || !ctx.source)
+      *term = enif_make_double(env, double(element));
+    else if constexpr (Floats == FLOATS_DECIMAL)
+      *term = make_decimal(env, next_number(ctx), ctx.source_end);
+    else {
+      const char *text = next_number(ctx);
+      size_t length = number_length(text, ctx.source_end);
+      char *bin = (char *)enif_make_new_binary(env, length, term);
+      std::memcpy(bin, text, length);
+    }
+    break;
+  case simdjson::dom::element_type::BOOL: {
+    *term = bool(element) ? ctx.true_term : ctx.false_term;
+  } break;
+  case simdjson::dom::element_type::NULL_VALUE: {
+    *term = ctx.null_term;
+  } break;
+  case simdjson::dom::element_type::STRING: {
+    std::string_view str = std::string_view(element);
+    char *str_bin = (char *)enif_make_new_binary(env, str.size(), term);
+    str.copy(str_bin, str.size());
+  } break;
+  case simdjson::dom::element_type::OBJECT: {
+    // Children are converted in document order, keeping their terms on
+    // ctx.stack as alternating keys and values. Nested containers only use
+    // the stack above `base` and restore it before returning.
+    auto &stack = ctx.stack;
+    size_t base = stack.size();
+    size_t keys_base = ctx.keys.size();
+    simdjson::dom::object obj = simdjson::dom::object(element);
+    for (auto [key, value] : obj) {
+      ERL_NIF_TERM k;
+      char *k_bin = (char *)enif_make_new_binary(env, key.size(), &k);
+      key.copy(k_bin, key.size());
+      stack.push_back(k);
+      if constexpr (Objects != OBJECTS_MAP)
+        ctx.keys.push_back(key);
+
+      ERL_NIF_TERM v;
+      int error = make_term<Floats, Objects>(env, value, &v, ctx);
+      if (error)
+        return error;
+      stack.push_back(v);
+    }
+
+    // Maps reject duplicate keys by themselves, so they are only looked for
+    // when that happens, with the keys gathered again. Lists are checked up
+    // front, with the keys gathered during the conversion.
+    size_t count = (stack.size() - base) / 2;
+    if constexpr (Objects != OBJECTS_MAP) {
+      int error = dedupe_keys(ctx, keys_base, base, &count);
+      ctx.keys.resize(keys_base);
+      if (error)
+        return error;
+    }
+    if constexpr (Objects == OBJECTS_MAP) {
+      while (true) {
+        for (size_t i = 0; i < count; i++)
+          stack.push_back(stack[base + 2 * i]);
+        for (size_t i = 0; i < count; i++)
+          stack.push_back(stack[base + 2 * i + 1]);
+        ERL_NIF_TERM *pairs = stack.data() + base + 2 * count;
+        if (enif_make_map_from_arrays(env, pairs, pairs + count, count, term))
+          break;
+
+        stack.resize(base + 2 * count);
+        for (auto field : obj)
+          ctx.keys.push_back(field.key);
+        int error = dedupe_keys(ctx, keys_base, base, &count);
+        ctx.keys.resize(keys_base);
+        if (error)
+          return error;
+      }
+    } else {
+      // Pairs are consed back to front, so the list is in document order.
+      ERL_NIF_TERM list = enif_make_list(env, 0);
+      for (size_t i = count; i > 0; i--) {
+        ERL_NIF_TERM pair = enif_make_tuple2(env, stack[base + 2 * i - 2],
+                                             stack[base + 2 * i - 1]);
+        list = enif_make_list_cell(env, pair, list);
+      }
+      *term = Objects == OBJECTS_TUPLE_LIST ? enif_make_tuple1(env, list)
+                                            : list;
+    }
+    stack.resize(base);
+
+  } break;
+  case simdjson::dom::element_type::ARRAY: {
+    auto &stack = ctx.stack;
+    size_t base = stack.size();
+    for (simdjson::dom::element e : simdjson::dom::array(element)) {
+      ERL_NIF_TERM car;
+      int error = make_term<Floats, Objects>(env, e, &car, ctx);
+      if (error)
+        return error;
+      stack.push_back(car);
+    }
+
+    *term = enif_make_list_from_array(env, stack.data() + base,
+                                      stack.size() - base);
+    stack.resize(base);
+
+  } break;
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+size_t estimate_term_words(const simdjson::dom::document &doc,
+                           term_context ctx, size_t *binary_bytes) {
+  // The tape is walked in document order, consuming numbers, big integers
+  // and structurals exactly as make_term does. A container is sized when it
+  // closes, from the count of its values kept on `counts`.
+  using simdjson::internal::JSON_VALUE_MASK;
+  const uint64_t *tape = doc.tape.get();
+  size_t end = tape[0] & JSON_VALUE_MASK;
+  const int64_t small_max = int64_t(1) << (SMALL_INTEGER_BITS - 1);
+  std::vector<size_t> counts;
+  size_t words = 0;
+  size_t off_heap = 0;
+  for (size_t i = 1; i < end; i++) {
+    char type = char(tape[i] >> 56);
+    if (type != ']' && type != '}' && !counts.empty())
+      counts.back()++;
+
+    switch (type) {
+    case '"': {
+      uint32_t length;
+      std::memcpy(&length,
+                  doc.string_buf.get() + (tape[i] & JSON_VALUE_MASK),
+                  sizeof(length));
+      words += binary_words(length);
+      off_heap += length > HEAP_BINARY_LIMIT ? length : 0;
+    } break;
+    case 'l': {
+      if (ctx.source)
+        next_number(ctx);
+      int64_t value = int64_t(tape[++i]);
+      if (ctx.big_integers && next_is_big_integer(ctx))
+        words += big_integer_words(
+            ctx.big_integers->integers[ctx.next_big_integer++].length);
+      else if (value < -small_max || value >= small_max)
+        words += 2;
+    } break;
+    case 'u':
+      if (ctx.source)
+        next_number(ctx);
+      ctx.numbers += ctx.big_integers != nullptr;
+      words += tape[++i] >= uint64_t(small_max) ? 2 : 0;
+      break;
+    case 'd':
+      i++;
+      ctx.numbers += ctx.big_integers != nullptr;
+      if (ctx.options.floats == FLOATS_FLOAT || !ctx.source)
+        words += 2;
+      else if (ctx.options.floats == FLOATS_DECIMAL)
+        words += decimal_words(next_number(ctx), ctx.source_end);
+      else {
+        size_t length = number_length(next_number(ctx), ctx.source_end);
+        words += binary_words(length);
+        off_heap += length > HEAP_BINARY_LIMIT ? length : 0;
+      }
+      break;
+    case '[':
+    case '{':
+      counts.push_back(0);
+      break;
+    case ']':
+      words += 2 * counts.back();
+      counts.pop_back();
+      break;
+    case '}':
+      // Keys and values were counted alike.
+      words += object_words(counts.back() / 2, ctx.options.objects);
+      counts.pop_back();
+      break;
+    default:
+      break;
+    }
+  }
+  if (binary_bytes)
+    *binary_bytes += off_heap;
+
+  return words;
+}
+
+size_t estimate_element_words(const simdjson::dom::element element,
+                              object_format objects, size_t limit) {
+  const int64_t small_max = int64_t(1) << (SMALL_INTEGER_BITS - 1);
+  size_t words = 0;
+  switch (element.type()) {
+  case simdjson::dom::element_type::INT64: {
+    int64_t value = int64_t(element);
+    return value < -small_max || value >= small_max ? 2 : 0;
+  }
+  case simdjson::dom::element_type::UINT64:
+    return uint64_t(element) >= uint64_t(small_max) ? 2 : 0;
+  case simdjson::dom::element_type::DOUBLE:
+    return 2;
+  case simdjson::dom::element_type::STRING:
+    return binary_words(std::string_view(element).size());
+  case simdjson::dom::element_type::OBJECT: {
+    // The tape saturates the size of wide objects, so the pairs are counted.
+    size_t pairs = 0;
+    for (auto [key, value] : simdjson::dom::object(element)) {
+      words += binary_words(key.size()) +
+               estimate_element_words(value, objects, limit - words);
+      pairs++;
+      if (words > limit)
+        return words;
+    }
+    return words + object_words(pairs, objects);
+  }
+  case simdjson::dom::element_type::ARRAY:
+    for (simdjson::dom::element value : simdjson::dom::array(element)) {
+      words += 2 + estimate_element_words(value, objects, limit - words);
+      if (words > limit)
+        return words;
+    }
+    return words;
+  default:
+    return 0;
+  }
+}
+
+int check_term_words(const simdjson::dom::document &doc,
+                     const term_context &ctx, size_t *words,
+                     size_t *binary_bytes) {
+  // Callers wanting the estimate as well get it from the same walk.
+  size_t limit = ctx.options.max_term_words;
+  if (!limit && !words)
+    return TERM_OK;
+  size_t estimate = estimate_term_words(doc, ctx, binary_bytes);
+  if (words)
+    *words = estimate;
+
+  return limit && estimate > limit ? TERM_TOO_LARGE : TERM_OK;
+}
+
+size_t binary_words(size_t size) {
+  // A heap binary is a header, its size and the bytes.
+  return size <= HEAP_BINARY_LIMIT ? 2 + (size + 7) / 8 : PROC_BIN_WORDS;
+}
+
+size_t big_integer_words(size_t digits) {
+  // A header and 64-bit digits, each holding at least 19 decimal ones.
+  return 1 + (digits + 18) / 19;
+}
+
+size_t decimal_words(const char *p, const char *end) {
+  // A 2-tuple, and a bignum when the coefficient has too many digits for a
+  // small integer, counted as make_decimal does.
+  size_t digits = 0;
+  for (p += p < end && *p == '-';
+       p < end && ((*p >= '0' && *p <= '9') || *p == '.'); p++)
+    digits += *p != '.' && (digits || *p != '0');
+
+  return 3 + (digits <= 17 ? 0 : big_integer_words(digits));
+}
+
+size_t object_words(size_t pairs, object_format objects) {
+  switch (objects) {
+  case OBJECTS_MAP:
+    // A flatmap is a header, its size, a key tuple and the values. The nodes
+    // of a hashmap take about 3.5 words per pair.
+    return pairs <= FLATMAP_MAX_KEYS ? 4 + 2 * pairs : 3 * pairs + pairs / 2;
+  case OBJECTS_PROPLIST:
+    // A cons and a 2-tuple per pair.
+    return 5 * pairs;
+  case OBJECTS_TUPLE_LIST:
+  default:
+    return 2 + 5 * pairs;
+  }
+}
+
+uint64_t key_hash(std::string_view key) {
+  // A word at a time, then the last word of the key, which overlaps the one
+  // before it when the size is not a multiple of 8. Only the bytes of the key
+  // are read, as JSON pointer tokens come from unpadded binaries.
+  const char *data = key.data();
+  size_t size = key.size();
+  uint64_t h = size * 0x9e3779b97f4a7c15;
+  for (size_t i = 0; i + 8 < size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    h = (h ^ word) * 0xff51afd7ed558ccd;
+    h ^= h >> 29;
+  }
+  uint64_t tail = 0;
+  if (size >= 8)
+    std::memcpy(&tail, data + size - 8, 8);
+  else
+    std::memcpy(&tail, data, size);
+
+  // The murmur3 finaliser spreads every input bit over the low bits used for
+  // slots.
+  h ^= tail * 0x9e3779b97f4a7c15;
+  h = (h ^ (h >> 33)) * 0xff51afd7ed558ccd;
+  h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53;
+  return h ^ (h >> 33);
+}
+
+int dedupe_keys(term_context &ctx, size_t keys_base, size_t base,
+                size_t *count) {
+  // Keys are entered into a chained hash table, in a fixed array for small
+  // objects so that the common case allocates nothing. With the last policy
+  // they are visited from the end, so that the first occurrence visited is
+  // always the one that is kept.
+  const std::string_view *keys = ctx.keys.data() + keys_base;
+  uint32_t n = ctx.keys.size() - keys_base;
+  bool from_end = ctx.options.duplicate_keys == DUPLICATE_KEYS_LAST;
+  if (n < 2) {
+    *count = n;
+    return TERM_OK;
+  }
+
+  uint32_t n_slots = 8;
+  while (n_slots < 2 * n)
+    n_slots *= 2;
+  uint32_t small_slots[2 * MAX_SMALL_DEDUPE_KEYS];
+  uint32_t small_next[MAX_SMALL_DEDUPE_KEYS];
+  uint32_t *slots = small_slots;
+  uint32_t *next = small_next;
+  if (n > MAX_SMALL_DEDUPE_KEYS) {
+    ctx.dedupe_slots.resize(n_slots + n);
+    slots = ctx.dedupe_slots.data();
+    next = slots + n_slots;
+  }
+  std::fill(slots, slots + n_slots, UINT32_MAX);
+
+  size_t duplicates = 0;
+  for (uint32_t k = 0; k < n; k++) {
+    uint32_t i = from_end ? n - 1 - k : k;
+    size_t slot = key_hash(keys[i]) & (n_slots - 1);
+    uint32_t j = slots[slot];
+    while (j != UINT32_MAX && keys[j] != keys[i])
+      j = next[j];
+    if (j != UINT32_MAX) {
+      // Duplicates are marked by pointing their chain at themselves, they
+      // are never reached from a slot.
+      next[i] = i;
+      duplicates++;
+    } else {
+      next[i] = slots[slot];
+      slots[slot] = i;
+    }
+  }
+
+  if (!duplicates) {
+    *count = n;
+    return TERM_OK;
+  }
+  if (ctx.options.duplicate_keys == DUPLICATE_KEYS_ERROR)
+    return TERM_DUPLICATE_KEY;
+
+  // Pairs which are kept stay in document order.
+  auto &stack = ctx.stack;
+  size_t out = 0;
+  for (uint32_t i = 0; i < n; i++)
+    if (next[i] != i) {
+      stack[base + 2 * out] = stack[base + 2 * i];
+      stack[base + 2 * out + 1] = stack[base + 2 * i + 1];
+      out++;
+    }
+  stack.resize(base + 2 * out);
+  *count = out;
+
+  return TERM_OK;
+}
+
+simdjson::error_code read_file(const char *path,
+                               std::unique_ptr<char, enif_deleter> &buf,
+                               size_t &capacity, size_t *len) {
+  // Same as dom::parser::load, except that the buffer is the caller's, which
+  // is reused across documents, and that it is allocated with enif_alloc so
+  // that the VM accounts for it.
+  std::FILE *fp = std::fopen(path, "rb");
+  if (!fp)
+    return simdjson::IO_ERROR;
+
+  long size;
+  if (std::fseek(fp, 0, SEEK_END) < 0 || (size = std::ftell(fp)) < 0) {
+    std::fclose(fp);
+    return simdjson::IO_ERROR;
+  }
+
+  auto error = reserve_buf(buf, capacity, size);
+  if (error) {
+    std::fclose(fp);
+    return error;
+  }
+
+  std::rewind(fp);
+  size_t bytes_read = std::fread(buf.get(), 1, size, fp);
+  if (std::fclose(fp) != 0 || bytes_read != size_t(size))
+    return simdjson::IO_ERROR;
+
+  *len = bytes_read;
+  return simdjson::SUCCESS;
+}
+
+simdjson::error_code reserve_buf(std::unique_ptr<char, enif_deleter> &buf,
+                                 size_t &capacity, size_t size) {
+  if (capacity < size || !buf) {
+    buf.reset();
+    buf.reset((char *)enif_alloc(size + simdjson::SIMDJSON_PADDING));
+    if (!buf) {
+      capacity = 0;
+      return simdjson::MEMALLOC;
+    }
+    capacity = size;
+  }
+
+  return simdjson::SUCCESS;
+}
+
+simdjson::simdjson_result<simdjson::dom::element>
+parse_big_integers(dom_parser_resource *res, char *buf, size_t len,
+                   big_integer_table &table) {
+  // Same as dom::parser::parse, with the stages run by the overload below.
+  simdjson::dom::parser &parser = res->parser;
+  if (parser.capacity() < len || !parser.doc.tape) {
+    if (len > parser.max_capacity())
+      return simdjson::CAPACITY;
+    auto error = parser.allocate(len, parser.max_depth());
+    if (error)
+      return error;
+  }
+
+  auto error =
+      parse_big_integers(*parser.implementation, parser.doc, buf, len, table);
+  if (error)
+    return error;
+
+  return parser.doc.root();
+}
+
+simdjson::error_code
+parse_big_integers(simdjson::internal::dom_parser_implementation &impl,
+                   simdjson::dom::document &doc, char *buf, size_t len,
+                   big_integer_table &table) {
+  // The oversized integers are taken out of the document between the two
+  // stages. Stage 1 has located every number by then, and overwriting one
+  // with "0" and spaces leaves those locations valid for stage 2.
+  auto error = impl.stage1((const uint8_t *)buf, len, false);
+  if (error)
+    return error;
+
+  size_t ordinal = 0;
+  for (uint32_t i = 0; i < impl.n_structural_indexes; i++) {
+    char *p = buf + impl.structural_indexes[i];
+    if (*p != '-' && (*p < '0' || *p > '9'))
+      continue;
+
+    size_t length = big_integer_length(p, buf + len);
+    if (length) {
+      bool negative = *p == '-';
+      table.integers.push_back({ordinal, table.digits.size(),
+                                length - negative, negative});
+      table.digits.append(p + negative, length - negative);
+      p[0] = '0';
+      std::memset(p + 1, ' ', length - 1);
+    }
+    ordinal++;
+  }
+
+  return impl.stage2(doc);
+}
+
+size_t big_integer_length(const char *p, const char *end) {
+  const char *start = p;
+  bool negative = *p == '-';
+  p += negative;
+  const char *digits = p;
+  while (p < end && *p >= '0' && *p <= '9')
+    p++;
+
+  // Anything but a well-formed integer is left for simdjson to handle or
+  // reject, including floats with a long mantissa.
+  size_t count = p - digits;
+  if (count == 0 || (*digits == '0' && count > 1) ||
+      count > MAX_BIG_INTEGER_DIGITS)
+    return 0;
+  if (p < end && (*p == '\0' || !std::strchr(" \t\n\r,]}", *p)))
+    return 0;
+
+  const char *limit = negative ? "9223372036854775808" : "18446744073709551615";
+  size_t limit_count = std::strlen(limit);
+  if (count < limit_count ||
+      (count == limit_count && std::memcmp(digits, limit, count) <= 0))
+    return 0;
+
+  return p - start;
+}
+
+int next_is_big_integer(term_context &ctx) {
+  const auto &integers = ctx.big_integers->integers;
+  return ctx.next_big_integer < integers.size() &&
+         integers[ctx.next_big_integer].ordinal == ctx.numbers++;
+}
+
+ERL_NIF_TERM make_big_integer(ErlNifEnv *env, const char *digits,
+                              size_t length, bool negative) {
+  // Convert the decimal digits to 32-bit limbs, least significant first, nine
+  // digits at a time.
+  std::vector<uint32_t> limbs;
+  for (size_t i = 0; i < length;) {
+    size_t n = std::min<size_t>(9, length - i);
+    uint64_t carry = 0;
+    uint64_t scale = 1;
+    for (size_t j = 0; j < n; j++, i++) {
+      carry = carry * 10 + (digits[i] - '0');
+      scale *= 10;
+    }
+    for (uint32_t &limb : limbs) {
+      uint64_t product = limb * scale + carry;
+      limb = uint32_t(product);
+      carry = product >> 32;
+    }
+    if (carry)
+      limbs.push_back(uint32_t(carry));
+  }
+
+  // Encode the magnitude as a SMALL_BIG_EXT or LARGE_BIG_EXT in the external
+  // term format, which erts decodes straight into a bignum.
+  std::vector<unsigned char> ext;
+  size_t bytes = limbs.size() * 4;
+  while (bytes && !(limbs[(bytes - 1) / 4] >> (8 * ((bytes - 1) % 4))))
+    bytes--;
+  ext.push_back(131);
+  if (bytes < 256) {
+    ext.push_back(110);
+    ext.push_back(uint8_t(bytes));
+  } else {
+    ext.push_back(111);
+    for (int shift = 24; shift >= 0; shift -= 8)
+      ext.push_back(uint8_t(bytes >> shift));
+  }
+  ext.push_back(negative);
+  for (size_t i = 0; i < bytes; i++)
+    ext.push_back(uint8_t(limbs[i / 4] >> (8 * (i % 4))));
+
+  ERL_NIF_TERM term;
+  if (!enif_binary_to_term(env, ext.data(), ext.size(), &term,
+                           ErlNifBinaryToTerm(0)))
+    return enif_make_badarg(env);
+
+  return term;
+}
+
+void init_term_context(term_context &ctx, const decode_options &options,
+                       const char *source, size_t len,
+                       const big_integer_table &big_integers,
+                       const uint32_t *structurals, size_t n_structurals) {
+  if (!big_integers.integers.empty())
+    ctx.big_integers = &big_integers;
+  ctx.options = options;
+
+  // The structural indexes of the parse locate the text of every number in
+  // the source.
+  if (options.floats != FLOATS_FLOAT) {
+    ctx.source = source;
+    ctx.source_end = source + len;
+    ctx.structurals = structurals;
+    ctx.structurals_end = structurals + n_structurals;
+  }
+}
+
+void watch_conversion(term_context &ctx, ErlNifEnv *caller_env,
+                      const ErlNifPid &caller, uint64_t start) {
+  ctx.deadline = deadline_from(ctx.options, start);
+  ctx.watch_caller = true;
+  ctx.caller = caller;
+  ctx.caller_env = caller_env;
+  // The first value is checked at once, in case the deadline passed or the
+  // caller exited during the parse.
+  ctx.until_check = 1;
+}
+
+int check_cancelled(term_context &ctx) {
+  ctx.until_check = CANCEL_CHECK_VALUES;
+  if (ctx.deadline && now_ns() >= ctx.deadline)
+    return TERM_DEADLINE;
+  if (ctx.watch_caller && !enif_is_process_alive(ctx.caller_env, &ctx.caller))
+    return TERM_CALLER_DOWN;
+
+  return TERM_OK;
+}
+
+uint64_t deadline_from(const decode_options &options, uint64_t start) {
+  return options.deadline_ms ? start + options.deadline_ms * 1000000 : 0;
+}
+
+const char *next_number(term_context &ctx) {
+  // Numbers are the only values starting with '-' or a digit, and come in the
+  // same order in the structural indexes as on the tape.
+  while (ctx.structurals < ctx.structurals_end) {
+    const char *p = ctx.source + *ctx.structurals++;
+    if (*p == '-' || (*p >= '0' && *p <= '9'))
+      return p;
+  }
+
+  return ctx.source_end;
+}
+
+size_t number_length(const char *p, const char *end) {
+  const char *start = p;
+  while (p < end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' ||
+                     *p == '.' || *p == 'e' || *p == 'E'))
+    p++;
+
+  return p - start;
+}
+
+ERL_NIF_TERM make_decimal(ErlNifEnv *env, const char *p, const char *end) {
+  // Leading zeros are dropped from the coefficient, but trailing ones are
+  // kept, so that 1.50 gives {150, -2} and the scale of amounts is preserved.
+  bool negative = p < end && *p == '-';
+  p += negative;
+  std::string digits;
+  uint64_t coefficient = 0;
+  int64_t exponent = 0;
+  bool fraction = false;
+  for (; p < end && ((*p >= '0' && *p <= '9') || *p == '.'); p++) {
+    if (*p == '.') {
+      fraction = true;
+      continue;
+    }
+    exponent -= fraction;
+    if (digits.empty() && *p == '0')
+      continue;
+    digits.push_back(*p);
+    coefficient = coefficient * 10 + (*p - '0');
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    bool negative_exponent = p < end && *p == '-';
+    p += p < end && (*p == '-' || *p == '+');
+    // simdjson has already rejected exponents far outside the range of a
+    // double, this only guards the accumulator.
+    int64_t e = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+      if (e < INT32_MAX)
+        e = e * 10 + (*p - '0');
+    exponent += negative_exponent ? -e : e;
+  }
+
+  ERL_NIF_TERM coefficient_term;
+  if (digits.size() <= 18)
+    coefficient_term = enif_make_int64(
+        env, negative ? -int64_t(coefficient) : int64_t(coefficient));
+  else
+    coefficient_term =
+        make_big_integer(env, digits.data(), digits.size(), negative);
+
+  return enif_make_tuple2(env, coefficient_term,
+                          enif_make_int64(env, exponent));
+}
+
+void track_document(dom_parser_resource *res, size_t len) {
+  if (len > res->recent_peak)
+    res->recent_peak = len;
+
+  if (res->shrink_after && ++res->recent_documents >= res->shrink_after)
+    trim_parser(res, SHRINK_RATIO);
+
+  account_memory(res);
+}
+
+simdjson::error_code trim_parser(dom_parser_resource *res, size_t ratio) {
+  size_t target = res->recent_peak;
+  res->recent_peak = 0;
+  res->recent_documents = 0;
+
+  // A fixed capacity parser has a max capacity of 0, and could not grow back.
+  if (res->parser.max_capacity() == 0)
+    return simdjson::SUCCESS;
+
+  if (res->load_buf_capacity > target * ratio) {
+    res->load_buf.reset();
+    res->load_buf_capacity = 0;
+    res->load_buf_generation++;
+  }
+
+  if (res->parser.capacity() > target * ratio)
+    return res->parser.allocate(target, res->parser.max_depth());
+
+  return simdjson::SUCCESS;
+}
+
+parser_memory get_parser_memory(const dom_parser_resource *res) {
+  // simdjson allocates these buffers with new[], out of the VM's sight, so
+  // their sizes are derived from the capacity and depth the same way that
+  // dom::document::allocate and dom_parser_implementation::allocate do.
+  parser_memory mem = {};
+  const simdjson::dom::parser &parser = res->parser;
+  size_t capacity = parser.capacity();
+
+  if (parser.doc.tape) {
+    mem.tape = SIMDJSON_ROUNDUP_N(capacity + 3, 64) * sizeof(uint64_t);
+    mem.string_buf =
+        SIMDJSON_ROUNDUP_N(5 * capacity / 3 + simdjson::SIMDJSON_PADDING, 64);
+  }
+  if (parser.implementation) {
+    mem.structural_indexes =
+        (SIMDJSON_ROUNDUP_N(capacity, 64) + 2 + 7) * sizeof(uint32_t);
+    // An open_container (two uint32_t) and an is_array flag per level
+    mem.depth_stacks = parser.max_depth() * (2 * sizeof(uint32_t) + 1);
+  }
+  if (res->load_buf)
+    mem.load_buf = res->load_buf_capacity + simdjson::SIMDJSON_PADDING;
+
+  mem.total = sizeof(dom_parser_resource) + mem.tape + mem.string_buf +
+              mem.structural_indexes + mem.depth_stacks + mem.load_buf;
+  return mem;
+}
+
+void account_memory(dom_parser_resource *res) {
+  size_t total = get_parser_memory(res).total;
+  memory_held.fetch_add(total - res->accounted_memory,
+                        std::memory_order_relaxed);
+  res->accounted_memory = total;
+}
+
+uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void stats_add_parse(parser_stats &stats, size_t bytes,
+                     simdjson::error_code error, size_t capacity,
+                     uint64_t parse_ns) {
+  stats.documents.fetch_add(1, std::memory_order_relaxed);
+  stats.bytes.fetch_add(bytes, std::memory_order_relaxed);
+  stats.parse_ns.fetch_add(parse_ns, std::memory_order_relaxed);
+  if (error)
+    stats.errors[error].fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t peak = stats.peak_capacity.load(std::memory_order_relaxed);
+  while (capacity > peak && !stats.peak_capacity.compare_exchange_weak(
+                                peak, capacity, std::memory_order_relaxed))
+    ;
+}
+
+void record_parse(dom_parser_resource *res, histogram_phase phase,
+                  size_t bytes, simdjson::error_code error, uint64_t parse_ns) {
+  size_t capacity = res->parser.capacity();
+  stats_add_parse(res->stats, bytes, error, capacity, parse_ns);
+  stats_add_parse(global_stats, bytes, error, capacity, parse_ns);
+  histogram_record(phase, bytes, parse_ns);
+}
+
+void record_convert(dom_parser_resource *res, size_t bytes,
+                    uint64_t convert_ns) {
+  res->stats.convert_ns.fetch_add(convert_ns, std::memory_order_relaxed);
+  global_stats.convert_ns.fetch_add(convert_ns, std::memory_order_relaxed);
+  histogram_record(HISTOGRAM_CONVERT, bytes, convert_ns);
+}
+
+ERL_NIF_TERM make_stats(ErlNifEnv *env, const parser_stats &stats) {
+  ERL_NIF_TERM errors = enif_make_new_map(env);
+  for (int i = 1; i < simdjson::NUM_ERROR_CODES; i++) {
+    uint64_t count = stats.errors[i].load(std::memory_order_relaxed);
+    if (count)
+      enif_make_map_put(env, errors, make_atom(env, error_code_txt[i].txt),
+                        enif_make_uint64(env, count), &errors);
+  }
+
+  ERL_NIF_TERM keys[] = {
+      make_atom(env, "documents"), make_atom(env, "bytes"),
+      make_atom(env, "errors"),    make_atom(env, "peak_capacity"),
+      make_atom(env, "parse_ns"),  make_atom(env, "convert_ns"),
+  };
+  ERL_NIF_TERM values[] = {
+      enif_make_uint64(env, stats.documents.load(std::memory_order_relaxed)),
+      enif_make_uint64(env, stats.bytes.load(std::memory_order_relaxed)),
+      errors,
+      enif_make_uint64(env,
+                       stats.peak_capacity.load(std::memory_order_relaxed)),
+      enif_make_uint64(env, stats.parse_ns.load(std::memory_order_relaxed)),
+      enif_make_uint64(env, stats.convert_ns.load(std::memory_order_relaxed)),
+  };
+  ERL_NIF_TERM map;
+  enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(*keys),
+                            &map);
+
+  return map;
+}
+
+ERL_NIF_TERM make_histogram(ErlNifEnv *env, histogram_phase phase) {
+  static const char *size_class_names[NUM_SIZE_CLASSES] = {"tiny", "small",
+                                                           "medium", "large"};
+  ERL_NIF_TERM keys[NUM_SIZE_CLASSES];
+  ERL_NIF_TERM values[NUM_SIZE_CLASSES];
+  uint64_t counts[HISTOGRAM_BUCKETS];
+
+  for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+    histogram_snapshot(phase, histogram_size_class(c), counts);
+
+    // Only non-empty buckets are reported, as {UpperBoundNs, Count} pairs in
+    // ascending order.
+    ERL_NIF_TERM buckets = enif_make_list(env, 0);
+    for (size_t b = HISTOGRAM_BUCKETS; b > 0; b--) {
+      if (!counts[b - 1])
+        continue;
+      uint64_t limit = histogram_bucket_limit(b - 1);
+      ERL_NIF_TERM bucket = enif_make_tuple2(
+          env,
+          limit == UINT64_MAX ? make_atom(env, "infinity")
+                              : enif_make_uint64(env, limit),
+          enif_make_uint64(env, counts[b - 1]));
+      buckets = enif_make_list_cell(env, bucket, buckets);
+    }
+    keys[c] = make_atom(env, size_class_names[c]);
+    values[c] = buckets;
+  }
+
+  ERL_NIF_TERM map;
+  enif_make_map_from_arrays(env, keys, values, NUM_SIZE_CLASSES, &map);
+
+  return map;
+}
+
+int start_free_thread() {
+  free_mutex = enif_mutex_create((char *)"esimdjson_free_mutex");
+  free_cond = enif_cond_create((char *)"esimdjson_free_cond");
+  int error = -1;
+  if (free_mutex && free_cond) {
+    free_thread_stop = false;
+    error = enif_thread_create((char *)"esimdjson_free", &free_tid,
+                               free_thread_main, nullptr, nullptr);
+  }
+  if (error) {
+    if (free_cond)
+      enif_cond_destroy(free_cond);
+    if (free_mutex)
+      enif_mutex_destroy(free_mutex);
+    free_mutex = nullptr;
+    free_cond = nullptr;
+  }
+
+  return error;
+}
+
+void stop_free_thread() {
+  enif_mutex_lock(free_mutex);
+  free_thread_stop = true;
+  enif_cond_signal(free_cond);
+  enif_mutex_unlock(free_mutex);
+
+  // The thread drains the queue before it exits.
+  enif_thread_join(free_tid, nullptr);
+  enif_cond_destroy(free_cond);
+  enif_mutex_destroy(free_mutex);
+  // Resources can outlive the library being unloaded, and are then freed
+  // inline by their destructor.
+  free_mutex = nullptr;
+  free_cond = nullptr;
+}
+
+void *free_thread_main(void *arg) {
+  enif_mutex_lock(free_mutex);
+  for (;;) {
+    while (!free_queue && !free_thread_stop)
+      enif_cond_wait(free_cond, free_mutex);
+    if (!free_queue)
+      break;
+
+    deferred_free *item = free_queue;
+    free_queue = item->next;
+    enif_mutex_unlock(free_mutex);
+
+    size_t bytes = item->bytes;
+    delete item;
+    memory_held.fetch_sub(bytes, std::memory_order_relaxed);
+    pending_frees.fetch_sub(1, std::memory_order_relaxed);
+
+    enif_mutex_lock(free_mutex);
+  }
+  enif_mutex_unlock(free_mutex);
+
+  return nullptr;
+}
+
+void defer_free(dom_parser_resource *res) {
+  // Moving the parser and the load buffer out of the resource leaves it
+  // holding nothing, so destroying the resource afterwards is cheap.
+  deferred_free *item =
+      new deferred_free{std::move(res->parser), std::move(res->load_buf),
+                        nullptr, res->accounted_memory, nullptr};
+  queue_free(item);
+}
+
+void queue_free(deferred_free *item) {
+  pending_frees.fetch_add(1, std::memory_order_relaxed);
+
+  enif_mutex_lock(free_mutex);
+  item->next = free_queue;
+  free_queue = item;
+  enif_cond_signal(free_cond);
+  enif_mutex_unlock(free_mutex);
+}
+
+void release_document(std::shared_ptr<stored_document> doc) {
+  // The tape, string buffer and indexes of a published document are freed
+  // with its last reference, so a large one is dropped on the free thread.
+  // The use count is only a hint: a lookup dropping another reference at the
+  // same time may still free it inline. The document stays counted in
+  // document_store_memory until it is freed.
+  if (doc && doc.use_count() == 1 && free_mutex && async_free_threshold &&
+      doc->memory + doc->index_memory.load(std::memory_order_relaxed) >=
+          async_free_threshold)
+    queue_free(new deferred_free{simdjson::dom::parser(), nullptr,
+                                 std::move(doc), 0, nullptr});
+}
+
+void release_buffers(dom_parser_resource *res) {
+  // Freeing large buffers can take long enough to stall the scheduler doing
+  // it, so those are handed over to the free thread. They stay accounted in
+  // memory_held until they are actually released.
+  if (free_mutex && async_free_threshold &&
+      res->accounted_memory >= async_free_threshold)
+    defer_free(res);
+  else
+    memory_held.fetch_sub(res->accounted_memory, std::memory_order_relaxed);
+  res->accounted_memory = 0;
+}
+
+int enter_parser(dom_parser_resource *res) {
+  if (!res->mutex)
+    return 1;
+
+  enif_mutex_lock(res->mutex);
+  int ret = !res->owner_down;
+  if (ret)
+    res->busy = true;
+  enif_mutex_unlock(res->mutex);
+
+  return ret;
+}
+
+void leave_parser(dom_parser_resource *res) {
+  if (!res->mutex)
+    return;
+
+  enif_mutex_lock(res->mutex);
+  res->busy = false;
+  if (res->owner_down)
+    drop_parser(res);
+  enif_mutex_unlock(res->mutex);
+}
+
+void drop_parser(dom_parser_resource *res) {
+  release_buffers(res);
+  res->parser = simdjson::dom::parser();
+  res->load_buf.reset();
+  res->load_buf_capacity = 0;
+  res->load_buf_generation++;
+}
+
+void dom_parser_down(ErlNifEnv *env, void *obj, ErlNifPid *pid,
+                     ErlNifMonitor *mon) {
+  // A NIF running on the parser drops it when it is done, so that the down
+  // callback never waits for a parse to finish.
+  dom_parser_resource *res = (dom_parser_resource *)obj;
+  enif_mutex_lock(res->mutex);
+  res->owner_down = true;
+  if (!res->busy)
+    drop_parser(res);
+  enif_mutex_unlock(res->mutex);
+}
+
+void dom_parser_dtor(ErlNifEnv *env, void *obj) {
+  // Memory deallocation is done by Erlang GC since we released the resource
+  // with `enif_release_resource`, so we only need to do object destruction.
+  dom_parser_resource *res = (dom_parser_resource *)obj;
+  release_buffers(res);
+  if (res->mutex)
+    enif_mutex_destroy(res->mutex);
+  if (res->terms_env)
+    enif_free_env(res->terms_env);
+  res->~dom_parser_resource();
+}
+
+void decode_profile_dtor(ErlNifEnv *env, void *obj) {
+  decode_profile_resource *profile = (decode_profile_resource *)obj;
+  if (profile->terms_env)
+    enif_free_env(profile->terms_env);
+  profile->~decode_profile_resource();
 }
 
 static ErlNifFunc nif_funcs[] = {
     {"parse", 2, nif_parse, ERL_NIF_DIRTY_JOB_CPU_BOUND},
-    {"load", 2, nif_load, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"load", 2, nif_load, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"parse", 3, nif_parse, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"load", 3, nif_load, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"parse_batch", 2, nif_parse_batch},
+    {"parse_parallel", 2, nif_parse_parallel, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"parse_async", 2, nif_parse_async},
+    {"load_batch", 2, nif_load_batch, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"estimate", 2, nif_estimate, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"decode_profile", 1, nif_decode_profile},
     {"new", 1, nif_new},
     {"max_capacity", 1, nif_max_capacity},
+    {"trim", 1, nif_trim, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"memory", 0, nif_memory},
+    {"memory", 1, nif_memory},
+    {"pending_frees", 0, nif_pending_frees},
+    {"stats", 0, nif_stats},
+    {"stats", 1, nif_stats},
+    {"new_cache", 2, nif_new_cache},
+    {"cache_stats", 1, nif_cache_stats},
+    {"publish", 2, nif_publish, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"publish", 3, nif_publish, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"lookup", 2, nif_lookup},
+    {"lookup", 3, nif_lookup},
+    {"unpublish", 1, nif_unpublish},
+    {"document_stats", 1, nif_document_stats},
+    {"histograms", 0, nif_histograms},
+    {"implementations", 0, nif_implementations},
+    {"active_implementation", 0, nif_active_implementation},
 };
 
-ERL_NIF_INIT(esimdjson, nif_funcs, load, nullptr, nullptr, nullptr)
+ERL_NIF_INIT(esimdjson, nif_funcs, load, nullptr, nullptr, unload)
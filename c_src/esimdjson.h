@@ -1,5 +1,12 @@
+#include "decode.h"
+#include "document_store.h"
 #include "erl_nif.h"
+#include "histogram.h"
+#include "result_cache.h"
 #include "simdjson.h"
+#include "thread_pool.h"
+
+#include <atomic>
 
 static ERL_NIF_TERM atom_ok;
 static ERL_NIF_TERM atom_error;
@@ -8,6 +15,71 @@ static ERL_NIF_TERM atom_true;
 static ERL_NIF_TERM atom_false;
 static ERL_NIF_TERM atom_fixed_capacity;
 static ERL_NIF_TERM atom_max_capacity;
+static ERL_NIF_TERM atom_max_depth;
+static ERL_NIF_TERM atom_implementation;
+static ERL_NIF_TERM atom_shrink_after;
+static ERL_NIF_TERM atom_async_free_threshold;
+static ERL_NIF_TERM atom_owner;
+static ERL_NIF_TERM atom_owner_down;
+static ERL_NIF_TERM atom_big_integers;
+static ERL_NIF_TERM atom_floats;
+static ERL_NIF_TERM atom_float;
+static ERL_NIF_TERM atom_decimal;
+static ERL_NIF_TERM atom_binary;
+static ERL_NIF_TERM atom_objects;
+static ERL_NIF_TERM atom_map;
+static ERL_NIF_TERM atom_proplist;
+static ERL_NIF_TERM atom_tuple_list;
+static ERL_NIF_TERM atom_duplicate_keys;
+static ERL_NIF_TERM atom_first;
+static ERL_NIF_TERM atom_last;
+static ERL_NIF_TERM atom_null_term;
+static ERL_NIF_TERM atom_true_term;
+static ERL_NIF_TERM atom_false_term;
+static ERL_NIF_TERM atom_pool_workers;
+static ERL_NIF_TERM atom_esimdjson;
+static ERL_NIF_TERM atom_deadline_ms;
+static ERL_NIF_TERM atom_max_term_words;
+static ERL_NIF_TERM atom_cache;
+static ERL_NIF_TERM atom_max_memory;
+static ERL_NIF_TERM atom_index_after;
+static ERL_NIF_TERM atom_not_found;
+static ERL_NIF_TERM atom_max_index_memory;
+
+/// With {shrink_after, N}, a parser is shrunk when its capacity is more than
+/// SHRINK_RATIO times the largest of its last N documents.
+#define SHRINK_RATIO 4
+
+/// Approximate length of a scheduler timeslice. parse_batch reports the time
+/// it used to the scheduler every tenth of it.
+#define TIMESLICE_NS 1000000
+/// Documents of at least this many bytes take too long for a normal scheduler,
+/// and move the rest of a batch to a dirty scheduler.
+#define BATCH_MAX_INLINE_SIZE (64 << 10)
+/// Heap words of a looked up value above which lookup converts it on a dirty
+/// scheduler
+#define LOOKUP_MAX_INLINE_WORDS 4096
+/// Documents per pool thread which parse_parallel and load_batch may parse
+/// ahead of the conversion, each holding its tape until converted
+#define PARALLEL_AHEAD_PER_WORKER 2
+/// Bytes a cache may hold when new_cache is not given {max_memory, N}
+#define CACHE_DEFAULT_MAX_MEMORY (64 << 20)
+
+struct term_error_txt_t {
+  const char *atom;
+  const char *message;
+};
+
+/// Reasons and messages of the errors from converting a document, indexed by
+/// term_error
+const term_error_txt_t term_error_txt[]{
+    {"ok", "No error"},
+    {"duplicate_key", "The JSON object has a duplicate key."},
+    {"deadline", "The deadline passed before the document was decoded."},
+    {"caller_down",
+     "The calling process exited before the document was decoded."},
+    {"term_too_large", "The decoded term would be larger than max_term_words."},
+};
 
 struct error_txt {
   simdjson::error_code code;
@@ -69,26 +141,385 @@ const error_txt error_code_txt[]{
     {simdjson::PARSER_IN_USE, "parser_in_use"},
 };
 
+/// Cumulative counters, kept for every parser resource and module-wide.
+/// The counters are independent of each other and are only read as a
+/// snapshot for reporting, so all accesses use relaxed ordering.
+struct parser_stats {
+  /// Documents passed to parse or load, including failed ones
+  std::atomic<uint64_t> documents{0};
+  /// Total size of those documents
+  std::atomic<uint64_t> bytes{0};
+  /// Failed documents, indexed by simdjson::error_code
+  std::atomic<uint64_t> errors[simdjson::NUM_ERROR_CODES]{};
+  /// Largest capacity the parser has been allocated to
+  std::atomic<uint64_t> peak_capacity{0};
+  /// Time spent in simdjson (including file reads for load)
+  std::atomic<uint64_t> parse_ns{0};
+  /// Time spent converting the DOM to Erlang terms
+  std::atomic<uint64_t> convert_ns{0};
+};
+
+/// Module-wide counters, aggregated over every parser ever created.
+static parser_stats global_stats;
+
+/// Bytes held by all parsers, reported by esimdjson:memory/0 along with the
+/// published documents
+static std::atomic<uint64_t> memory_held{0};
+
+/// Bytes held by a parser, by buffer
+struct parser_memory {
+  size_t total;
+  size_t tape;
+  size_t string_buf;
+  size_t structural_indexes;
+  size_t depth_stacks;
+  size_t load_buf;
+};
+
+struct enif_deleter {
+  void operator()(void *ptr) const { enif_free(ptr); }
+};
+
+/// The object held by an "esimdjson_dom_parser" resource
+struct dom_parser_resource {
+  simdjson::dom::parser parser;
+  parser_stats stats;
+  /// Padded buffer for files read by load, reused across calls
+  std::unique_ptr<char, enif_deleter> load_buf;
+  size_t load_buf_capacity = 0;
+  /// Bumped whenever load_buf is written or freed, so that the parse phase of
+  /// load can tell that the file it read is still there
+  uint64_t load_buf_generation = 0;
+  /// Bytes last added to memory_held for this parser
+  size_t accounted_memory = 0;
+  /// Documents between automatic trims, or 0 to never trim automatically
+  size_t shrink_after = 0;
+  /// Documents and largest document size since the last trim
+  size_t recent_documents = 0;
+  size_t recent_peak = 0;
+  /// Monitor on the process given with {owner, Pid}
+  ErlNifMonitor owner_monitor;
+  /// Protects busy and owner_down, only created for parsers with an owner
+  ErlNifMutex *mutex = nullptr;
+  /// Whether a NIF is using the parser's buffers
+  bool busy = false;
+  /// Whether the owner has exited, after which the buffers are dropped
+  bool owner_down = false;
+  /// Options given to esimdjson:new/1, used unless a call gives a profile
+  decode_options options;
+  /// Holds the terms of options which are not atoms
+  ErlNifEnv *terms_env = nullptr;
+};
+
+/// The object held by an "esimdjson_decode_profile" resource
+struct decode_profile_resource {
+  decode_options options;
+  ErlNifEnv *terms_env = nullptr;
+};
+
+/// Resource type of decode profiles. The parser resource type is kept as the
+/// NIF's private data.
+static ErlNifResourceType *decode_profile_type;
+
+/// Parsers holding at least this many bytes are released on a background
+/// thread when they are garbage collected. Set with the async_free_threshold
+/// application environment variable, where 0 disables the thread's use.
+#define DEFAULT_ASYNC_FREE_THRESHOLD (16 << 20)
+static size_t async_free_threshold = DEFAULT_ASYNC_FREE_THRESHOLD;
+
+/// Buffers taken from a garbage collected parser, or the last reference to
+/// an unpublished document, queued for release
+struct deferred_free {
+  simdjson::dom::parser parser;
+  std::unique_ptr<char, enif_deleter> load_buf;
+  std::shared_ptr<stored_document> document;
+  /// Bytes to remove from memory_held once released
+  size_t bytes;
+  deferred_free *next;
+};
+
+/// Queue of the background free thread, protected by free_mutex
+static ErlNifMutex *free_mutex;
+static ErlNifCond *free_cond;
+static ErlNifTid free_tid;
+static deferred_free *free_queue = nullptr;
+static bool free_thread_stop = false;
+/// Number of deferred_free items not released yet
+static std::atomic<uint64_t> pending_frees{0};
+
+/// State of a worker of the thread pool, for parse_parallel
+struct pool_worker {
+  simdjson::dom::parser parser;
+  /// Padded copy of the document being parsed
+  std::unique_ptr<char, enif_deleter> buf;
+  size_t buf_capacity = 0;
+  /// Bytes last added to memory_held for this worker
+  size_t accounted_memory = 0;
+};
+
+/// One pool_worker per thread of the pool, indexed by worker
+static std::unique_ptr<pool_worker[]> pool_workers;
+
+/// A document of parse_parallel or load_batch, parsed on a worker and
+/// converted by the caller
+struct parallel_document {
+  /// File to read the document from, only set by load_batch
+  std::string path;
+  /// Padded contents of the file, read by the worker
+  std::unique_ptr<char, enif_deleter> data;
+  size_t data_capacity = 0;
+  ErlNifBinary bin;
+  simdjson::error_code error = simdjson::SUCCESS;
+  /// Tape of the document, which outlives the parse on the worker
+  simdjson::dom::document doc;
+  big_integer_table big_integers;
+  /// Structural indexes of the document, only kept when numbers are taken
+  /// from their text
+  std::vector<uint32_t> structurals;
+  /// Whether the document has been parsed, protected by parallel_job::mutex
+  bool ready = false;
+  /// Whether the worker gave up on the document, the deadline having passed
+  bool expired = false;
+};
+
+/// A call of parse_parallel or load_batch. Its tasks take documents from
+/// `next` until there are none left, while the caller converts them in
+/// order.
+struct parallel_job {
+  parallel_document *documents;
+  size_t count;
+  const decode_options *options;
+  std::atomic<size_t> next{0};
+  ErlNifMutex *mutex;
+  ErlNifCond *cond;
+  /// Tasks which have not finished, protected by mutex
+  size_t running;
+  /// Whether the caller waits on cond, protected by mutex
+  bool waiting = false;
+  /// Documents converted by the caller, and the number of tasks waiting on
+  /// ahead_cond for it to grow, protected by mutex. A task only parses the
+  /// document `ahead` places past the conversion.
+  size_t converted = 0;
+  size_t ahead = 0;
+  size_t blocked = 0;
+  ErlNifCond *ahead_cond = nullptr;
+  /// Time by which the whole job must be done, or 0
+  uint64_t deadline = 0;
+  /// The term_error which stopped the caller's conversions, after which the
+  /// workers skip the documents left
+  std::atomic<int> cancelled{TERM_OK};
+};
+
+struct parallel_task {
+  /// First, so that the pool_task given to run is the parallel_task
+  pool_task task;
+  parallel_job *job;
+};
+
+/// A call of parse_async, run on the thread pool
+struct async_parse {
+  /// First, so that the pool_task given to run is the async_parse
+  pool_task task;
+  /// Kept until the task has run
+  dom_parser_resource *res;
+  ErlNifPid caller;
+  /// When parse_async was called, which the deadline counts from
+  uint64_t start;
+  /// Holds the binary and the reference, and the message built from them
+  ErlNifEnv *env;
+  ERL_NIF_TERM ref;
+  ERL_NIF_TERM bin;
+};
+
 /// NIF interface declarations
 static int load(ErlNifEnv *env, void **priv_data, const ERL_NIF_TERM load_info);
+static void unload(ErlNifEnv *env, void *priv_data);
 
 /// Actual NIF declarations
 static ERL_NIF_TERM nif_parse(ErlNifEnv *env, const int argc,
                               const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM nif_load(ErlNifEnv *env, const int argc,
                              const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_load_parse(ErlNifEnv *env, const int argc,
+                                   const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM nif_new(ErlNifEnv *env, const int argc,
                             const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_parse_batch(ErlNifEnv *env, const int argc,
+                                    const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_parse_parallel(ErlNifEnv *env, const int argc,
+                                       const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_load_batch(ErlNifEnv *env, const int argc,
+                                   const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_parse_async(ErlNifEnv *env, const int argc,
+                                    const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_estimate(ErlNifEnv *env, const int argc,
+                                 const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_decode_profile(ErlNifEnv *env, const int argc,
+                                       const ERL_NIF_TERM argv[]);
 static ERL_NIF_TERM nif_max_capacity(ErlNifEnv *env, const int argc,
                                      const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_trim(ErlNifEnv *env, const int argc,
+                             const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_memory(ErlNifEnv *env, const int argc,
+                               const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_pending_frees(ErlNifEnv *env, const int argc,
+                                      const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_stats(ErlNifEnv *env, const int argc,
+                              const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_new_cache(ErlNifEnv *env, const int argc,
+                                  const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_cache_stats(ErlNifEnv *env, const int argc,
+                                    const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_publish(ErlNifEnv *env, const int argc,
+                                const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_lookup(ErlNifEnv *env, const int argc,
+                               const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_unpublish(ErlNifEnv *env, const int argc,
+                                  const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_document_stats(ErlNifEnv *env, const int argc,
+                                       const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_histograms(ErlNifEnv *env, const int argc,
+                                   const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_implementations(ErlNifEnv *env, const int argc,
+                                        const ERL_NIF_TERM argv[]);
+static ERL_NIF_TERM nif_active_implementation(ErlNifEnv *env, const int argc,
+                                              const ERL_NIF_TERM argv[]);
 
 ERL_NIF_TERM make_simdjson_error(ErlNifEnv *env,
                                  const simdjson::error_code error);
+ERL_NIF_TERM make_owner_down_error(ErlNifEnv *env);
+ERL_NIF_TERM make_term_error(ErlNifEnv *env, const term_error error);
 ERL_NIF_TERM make_atom(ErlNifEnv *env, const char *atom);
 ERL_NIF_TERM make_ok_result(ErlNifEnv *env, const ERL_NIF_TERM result);
 ERL_NIF_TERM make_error(ErlNifEnv *env, const ERL_NIF_TERM reason);
-int make_term_from_dom(ErlNifEnv *env, const simdjson::dom::element element,
-                       ERL_NIF_TERM *term);
 void dom_parser_dtor(ErlNifEnv *env, void *obj);
+void decode_profile_dtor(ErlNifEnv *env, void *obj);
+void dom_parser_down(ErlNifEnv *env, void *obj, ErlNifPid *pid,
+                     ErlNifMonitor *mon);
+ERL_NIF_TERM load_document(ErlNifEnv *env, dom_parser_resource *res,
+                           size_t len, uint64_t start,
+                           const decode_options &options);
+ERL_NIF_TERM parse_document(ErlNifEnv *env, dom_parser_resource *res,
+                            const ErlNifBinary &bin,
+                            const decode_options &options);
+simdjson::error_code parse_binary(dom_parser_resource *res,
+                                  const ErlNifBinary &bin,
+                                  const decode_options &options,
+                                  big_integer_table &big_integers,
+                                  simdjson::dom::element *element);
+int check_term_words(const simdjson::dom::document &doc,
+                     const term_context &ctx, size_t *words = nullptr,
+                     size_t *binary_bytes = nullptr);
+uint64_t options_hash(const decode_options &options);
+ERL_NIF_TERM cached_result(ErlNifEnv *env, const cache_entry &entry,
+                           const decode_options &options);
+void cache_result(result_cache *cache, uint64_t hash, const ErlNifBinary &bin,
+                  ERL_NIF_TERM term, const decode_options &options,
+                  size_t words, size_t binary_bytes);
+size_t binary_words(size_t size);
+size_t big_integer_words(size_t digits);
+size_t decimal_words(const char *p, const char *end);
+size_t object_words(size_t pairs, object_format objects);
+int get_profile(ErlNifEnv *env, ERL_NIF_TERM arg,
+                const decode_options **options);
+int keep_literal_terms(ErlNifEnv *env, decode_options *options,
+                       ErlNifEnv **terms_env);
+ERL_NIF_TERM literal_term(ErlNifEnv *env, ERL_NIF_TERM term,
+                          ERL_NIF_TERM default_term);
+int enter_parser(dom_parser_resource *res);
+void leave_parser(dom_parser_resource *res);
+void drop_parser(dom_parser_resource *res);
+void release_buffers(dom_parser_resource *res);
+int start_free_thread();
+void stop_free_thread();
+void *free_thread_main(void *arg);
+void defer_free(dom_parser_resource *res);
+void queue_free(deferred_free *item);
+void release_document(std::shared_ptr<stored_document> doc);
+simdjson::error_code read_file(const char *path,
+                               std::unique_ptr<char, enif_deleter> &buf,
+                               size_t &capacity, size_t *len);
+simdjson::error_code reserve_buf(std::unique_ptr<char, enif_deleter> &buf,
+                                 size_t &capacity, size_t size);
+simdjson::simdjson_result<simdjson::dom::element>
+parse_big_integers(dom_parser_resource *res, char *buf, size_t len,
+                   big_integer_table &table);
+simdjson::error_code
+parse_big_integers(simdjson::internal::dom_parser_implementation &impl,
+                   simdjson::dom::document &doc, char *buf, size_t len,
+                   big_integer_table &table);
+ERL_NIF_TERM run_parallel_job(ErlNifEnv *env, parallel_job &job);
+void run_parallel_task(pool_task *task, size_t worker);
+void run_async_parse(pool_task *task, size_t worker);
+int convert_parallel_document(ErlNifEnv *env, parallel_document &document,
+                              const decode_options &options,
+                              ErlNifEnv *caller_env, const ErlNifPid &caller,
+                              uint64_t start, ERL_NIF_TERM *result);
+simdjson::error_code parse_parallel_document(pool_worker &worker,
+                                             parallel_document &document,
+                                             const decode_options &options);
+simdjson::error_code reserve_worker(pool_worker &worker, size_t size);
+simdjson::error_code allocate_document(simdjson::dom::document &doc,
+                                       size_t capacity);
+void account_worker_memory(pool_worker &worker);
+size_t big_integer_length(const char *p, const char *end);
+int next_is_big_integer(term_context &ctx);
+ERL_NIF_TERM make_big_integer(ErlNifEnv *env, const char *digits,
+                              size_t length, bool negative);
+template <float_format Floats, object_format Objects>
+int make_term(ErlNifEnv *env, const simdjson::dom::element element,
+              ERL_NIF_TERM *term, term_context &ctx);
+void init_term_context(term_context &ctx, const decode_options &options,
+                       const char *source, size_t len,
+                       const big_integer_table &big_integers,
+                       const uint32_t *structurals, size_t n_structurals);
+void watch_conversion(term_context &ctx, ErlNifEnv *caller_env,
+                      const ErlNifPid &caller, uint64_t start);
+int check_cancelled(term_context &ctx);
+uint64_t deadline_from(const decode_options &options, uint64_t start);
+const char *next_number(term_context &ctx);
+size_t number_length(const char *p, const char *end);
+ERL_NIF_TERM make_decimal(ErlNifEnv *env, const char *p, const char *end);
+void track_document(dom_parser_resource *res, size_t len);
+simdjson::error_code trim_parser(dom_parser_resource *res, size_t ratio);
+parser_memory get_parser_memory(const dom_parser_resource *res);
+void account_memory(dom_parser_resource *res);
+uint64_t now_ns();
+void stats_add_parse(parser_stats &stats, size_t bytes,
+                     simdjson::error_code error, size_t capacity,
+                     uint64_t parse_ns);
+void record_parse(dom_parser_resource *res, histogram_phase phase,
+                  size_t bytes, simdjson::error_code error, uint64_t parse_ns);
+void record_convert(dom_parser_resource *res, size_t bytes,
+                    uint64_t convert_ns);
+ERL_NIF_TERM make_stats(ErlNifEnv *env, const parser_stats &stats);
+ERL_NIF_TERM make_histogram(ErlNifEnv *env, histogram_phase phase);
 int get_max_capacity(ErlNifEnv *env, ERL_NIF_TERM opt, size_t *max_cap);
 int get_fixed_capacity(ErlNifEnv *env, ERL_NIF_TERM opt, size_t *fixed_cap);
+int get_max_depth(ErlNifEnv *env, ERL_NIF_TERM opt, size_t *max_depth);
+int get_shrink_after(ErlNifEnv *env, ERL_NIF_TERM opt, size_t *shrink_after);
+int get_owner(ErlNifEnv *env, ERL_NIF_TERM opt, ErlNifPid *owner);
+int get_big_integers(ErlNifEnv *env, ERL_NIF_TERM opt, bool *big_integers);
+int get_floats(ErlNifEnv *env, ERL_NIF_TERM opt, float_format *floats);
+int get_objects(ErlNifEnv *env, ERL_NIF_TERM opt, object_format *objects);
+int get_duplicate_keys(ErlNifEnv *env, ERL_NIF_TERM opt,
+                       duplicate_keys_policy *duplicate_keys);
+int get_decode_option(ErlNifEnv *env, ERL_NIF_TERM opt,
+                      decode_options *options);
+int get_literal_term(ErlNifEnv *env, ERL_NIF_TERM opt,
+                     decode_options *options);
+int get_deadline_ms(ErlNifEnv *env, ERL_NIF_TERM opt, uint64_t *deadline_ms);
+int get_max_term_words(ErlNifEnv *env, ERL_NIF_TERM opt,
+                       size_t *max_term_words);
+int get_cache(ErlNifEnv *env, ERL_NIF_TERM opt, result_cache **cache);
+int get_max_memory(ErlNifEnv *env, ERL_NIF_TERM opt, size_t *max_memory);
+int get_index_after(ErlNifEnv *env, ERL_NIF_TERM opt, uint64_t *index_after);
+int get_max_index_memory(ErlNifEnv *env, ERL_NIF_TERM opt,
+                         size_t *max_index_memory);
+int get_pool_workers(ErlNifEnv *env, ERL_NIF_TERM opt, size_t *workers);
+int get_async_free_threshold(ErlNifEnv *env, ERL_NIF_TERM opt,
+                             size_t *threshold);
+int get_implementation(ErlNifEnv *env, ERL_NIF_TERM opt,
+                       const simdjson::implementation **impl);
+const simdjson::implementation *find_implementation(ErlNifEnv *env,
+                                                    ERL_NIF_TERM name);
@@ -0,0 +1,73 @@
+#include "histogram.h"
+
+#include <atomic>
+
+struct alignas(64) histogram_shard {
+  std::atomic<uint64_t> counts[NUM_HISTOGRAM_PHASES][NUM_SIZE_CLASSES]
+                              [HISTOGRAM_BUCKETS]{};
+};
+
+static histogram_shard shards[HISTOGRAM_SHARDS];
+static std::atomic<unsigned> next_shard{0};
+
+/// Threads are assigned shards round-robin on their first recording. The VM
+/// has a fixed set of scheduler threads, so this amounts to a shard per
+/// scheduler as long as there are no more schedulers than shards.
+static histogram_shard &current_shard() {
+  thread_local histogram_shard *shard =
+      &shards[next_shard.fetch_add(1, std::memory_order_relaxed) %
+              HISTOGRAM_SHARDS];
+  return *shard;
+}
+
+histogram_size_class histogram_size_class_of(size_t bytes) {
+  if (bytes < (1 << 10))
+    return SIZE_TINY;
+  else if (bytes < (1 << 16))
+    return SIZE_SMALL;
+  else if (bytes < (1 << 20))
+    return SIZE_MEDIUM;
+  else
+    return SIZE_LARGE;
+}
+
+size_t histogram_bucket_of(uint64_t ns) {
+  // Values below HISTOGRAM_SUB_BUCKETS map to themselves; above that, the
+  // bucket is the position of the highest bit followed by the
+  // HISTOGRAM_SUB_BITS bits below it.
+  if (ns < HISTOGRAM_SUB_BUCKETS)
+    return ns;
+  int exp = 63 - __builtin_clzll(ns);
+  if (exp >= HISTOGRAM_MAX_EXP)
+    return HISTOGRAM_BUCKETS - 1;
+  size_t sub =
+      (ns >> (exp - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return (exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+uint64_t histogram_bucket_limit(size_t bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS)
+    return bucket + 1;
+  if (bucket == HISTOGRAM_BUCKETS - 1)
+    return UINT64_MAX;
+  int exp = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+  uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+  return uint64_t(HISTOGRAM_SUB_BUCKETS + sub + 1)
+         << (exp - HISTOGRAM_SUB_BITS);
+}
+
+void histogram_record(histogram_phase phase, size_t bytes, uint64_t ns) {
+  current_shard()
+      .counts[phase][histogram_size_class_of(bytes)][histogram_bucket_of(ns)]
+      .fetch_add(1, std::memory_order_relaxed);
+}
+
+void histogram_snapshot(histogram_phase phase, histogram_size_class size_class,
+                        uint64_t *counts) {
+  for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++)
+    counts[b] = 0;
+  for (const histogram_shard &shard : shards)
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++)
+      counts[b] +=
+          shard.counts[phase][size_class][b].load(std::memory_order_relaxed);
+}
@@ -0,0 +1,47 @@
+#include <cstddef>
+#include <cstdint>
+
+/// Operations with their own latency histograms
+enum histogram_phase {
+  HISTOGRAM_PARSE,
+  HISTOGRAM_LOAD,
+  HISTOGRAM_CONVERT,
+  NUM_HISTOGRAM_PHASES
+};
+
+/// Input size classes, so that the latency of small documents is not hidden
+/// by the occasional large one.
+enum histogram_size_class {
+  /// Less than 1 KiB
+  SIZE_TINY,
+  /// Less than 64 KiB
+  SIZE_SMALL,
+  /// Less than 1 MiB
+  SIZE_MEDIUM,
+  /// 1 MiB or more
+  SIZE_LARGE,
+  NUM_SIZE_CLASSES
+};
+
+/// Each power of two is split into 2^HISTOGRAM_SUB_BITS linear sub-buckets,
+/// which bounds the relative error of a bucket to 1 / 2^HISTOGRAM_SUB_BITS.
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+/// Latencies of 2^HISTOGRAM_MAX_EXP ns (about 18 minutes) or more all fall in
+/// the last bucket.
+#define HISTOGRAM_MAX_EXP 40
+#define HISTOGRAM_BUCKETS                                                      \
+  ((HISTOGRAM_MAX_EXP - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+/// Number of independent copies of the counters. Threads are spread over the
+/// shards so that concurrent schedulers rarely write to the same cache line.
+#define HISTOGRAM_SHARDS 16
+
+histogram_size_class histogram_size_class_of(size_t bytes);
+size_t histogram_bucket_of(uint64_t ns);
+/// The exclusive upper bound, in nanoseconds, of a bucket
+uint64_t histogram_bucket_limit(size_t bucket);
+/// Lock-free: increments one counter of the calling thread's shard.
+void histogram_record(histogram_phase phase, size_t bytes, uint64_t ns);
+/// Merges the shards into `counts`, which must hold HISTOGRAM_BUCKETS entries.
+void histogram_snapshot(histogram_phase phase, histogram_size_class size_class,
+                        uint64_t *counts);
@@ -0,0 +1,187 @@
+#include "result_cache.h"
+
+#include <cstring>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+using lru_list = std::list<std::shared_ptr<cache_entry>>;
+
+struct result_cache {
+  ERL_NIF_TERM name;
+  /// Entries, most recently used first, and their index by hash, protected
+  /// by mutex
+  ErlNifMutex *mutex;
+  lru_list lru;
+  std::unordered_map<uint64_t, lru_list::iterator> index;
+  size_t memory = 0;
+  size_t max_memory;
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};
+  std::atomic<uint64_t> evictions{0};
+};
+
+/// Caches by name, protected by registry_mutex. Caches are only freed by
+/// result_cache_stop, so the pointers held by decode profiles stay valid.
+static ErlNifMutex *registry_mutex;
+static std::vector<std::unique_ptr<result_cache>> registry;
+
+cache_entry::~cache_entry() {
+  if (env)
+    enif_free_env(env);
+}
+
+static bool same_options(const decode_options &a, const decode_options &b) {
+  // Only the options which change the term are compared, the limits are
+  // checked again on every hit.
+  auto same_term = [](ERL_NIF_TERM x, ERL_NIF_TERM y) {
+    return x == y || (x && y && enif_is_identical(x, y));
+  };
+  return a.big_integers == b.big_integers && a.floats == b.floats &&
+         a.objects == b.objects && a.duplicate_keys == b.duplicate_keys &&
+         same_term(a.null_term, b.null_term) &&
+         same_term(a.true_term, b.true_term) &&
+         same_term(a.false_term, b.false_term);
+}
+
+/// Drops least recently used entries until `memory` fits. Called with the
+/// cache's mutex held.
+static void evict(result_cache *cache, size_t memory) {
+  while (!cache->lru.empty() && cache->memory + memory > cache->max_memory) {
+    const std::shared_ptr<cache_entry> &entry = cache->lru.back();
+    cache->memory -= entry->memory;
+    cache->index.erase(entry->hash);
+    cache->lru.pop_back();
+    cache->evictions.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+int result_cache_start() {
+  registry_mutex = enif_mutex_create((char *)"esimdjson_cache_registry");
+  return registry_mutex ? 0 : -1;
+}
+
+void result_cache_stop() {
+  for (auto &cache : registry)
+    enif_mutex_destroy(cache->mutex);
+  registry.clear();
+  if (registry_mutex)
+    enif_mutex_destroy(registry_mutex);
+  registry_mutex = nullptr;
+}
+
+result_cache *result_cache_open(ERL_NIF_TERM name, size_t max_memory) {
+  enif_mutex_lock(registry_mutex);
+  result_cache *cache = nullptr;
+  for (auto &c : registry)
+    if (c->name == name)
+      cache = c.get();
+  if (!cache) {
+    ErlNifMutex *mutex = enif_mutex_create((char *)"esimdjson_cache");
+    if (mutex) {
+      registry.emplace_back(new result_cache());
+      cache = registry.back().get();
+      cache->name = name;
+      cache->mutex = mutex;
+    }
+  }
+  enif_mutex_unlock(registry_mutex);
+  if (!cache)
+    return nullptr;
+
+  enif_mutex_lock(cache->mutex);
+  cache->max_memory = max_memory;
+  evict(cache, 0);
+  enif_mutex_unlock(cache->mutex);
+
+  return cache;
+}
+
+result_cache *result_cache_find(ERL_NIF_TERM name) {
+  enif_mutex_lock(registry_mutex);
+  result_cache *cache = nullptr;
+  for (auto &c : registry)
+    if (c->name == name)
+      cache = c.get();
+  enif_mutex_unlock(registry_mutex);
+
+  return cache;
+}
+
+std::shared_ptr<cache_entry>
+result_cache_lookup(result_cache *cache, uint64_t hash,
+                    const ErlNifBinary &input, const decode_options &options) {
+  std::shared_ptr<cache_entry> entry;
+  enif_mutex_lock(cache->mutex);
+  auto it = cache->index.find(hash);
+  if (it != cache->index.end()) {
+    cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+    entry = *it->second;
+  }
+  enif_mutex_unlock(cache->mutex);
+
+  // The entry is compared outside of the lock, which it outlives for as long
+  // as it is referenced here.
+  if (entry && (entry->input.size != input.size ||
+                std::memcmp(entry->input.data, input.data, input.size) != 0 ||
+                !same_options(entry->options, options)))
+    entry.reset();
+  (entry ? cache->hits : cache->misses)
+      .fetch_add(1, std::memory_order_relaxed);
+
+  return entry;
+}
+
+void result_cache_insert(result_cache *cache,
+                         std::shared_ptr<cache_entry> entry) {
+  enif_mutex_lock(cache->mutex);
+  if (entry->memory <= cache->max_memory) {
+    // An entry of the same hash, for other bytes or options, is replaced.
+    auto it = cache->index.find(entry->hash);
+    if (it != cache->index.end()) {
+      cache->memory -= (*it->second)->memory;
+      cache->lru.erase(it->second);
+      cache->index.erase(it);
+    }
+    evict(cache, entry->memory);
+    cache->memory += entry->memory;
+    cache->lru.push_front(std::move(entry));
+    cache->index.emplace(cache->lru.front()->hash, cache->lru.begin());
+  }
+  enif_mutex_unlock(cache->mutex);
+}
+
+cache_stats result_cache_stats(result_cache *cache) {
+  cache_stats stats;
+  enif_mutex_lock(cache->mutex);
+  stats.entries = cache->lru.size();
+  stats.memory = cache->memory;
+  stats.max_memory = cache->max_memory;
+  enif_mutex_unlock(cache->mutex);
+  stats.hits = cache->hits.load(std::memory_order_relaxed);
+  stats.misses = cache->misses.load(std::memory_order_relaxed);
+  stats.evictions = cache->evictions.load(std::memory_order_relaxed);
+
+  return stats;
+}
+
+uint64_t content_hash(const unsigned char *data, size_t size, uint64_t seed) {
+  // Eight bytes at a time, with a multiply per word, then the murmur3
+  // finaliser. Collisions only cost a miss, as hits compare the bytes.
+  uint64_t h = seed ^ (size * 0x9e3779b97f4a7c15);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    h = (h ^ word) * 0xff51afd7ed558ccd;
+    h ^= h >> 29;
+  }
+  if (i < size) {
+    uint64_t word = 0;
+    std::memcpy(&word, data + i, size - i);
+    h = (h ^ word) * 0xff51afd7ed558ccd;
+  }
+  h = (h ^ (h >> 33)) * 0xff51afd7ed558ccd;
+  h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53;
+  return h ^ (h >> 33);
+}
@@ -0,0 +1,61 @@
+#include "decode.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/// A decoded document, kept in an env of its own so that it outlives the
+/// call which decoded it
+struct cache_entry {
+  ErlNifEnv *env = nullptr;
+  /// Key of the entry in its cache, from content_hash
+  uint64_t hash;
+  /// The input, compared on a hit so that a hash collision is never
+  /// returned, and the term decoded from it
+  ErlNifBinary input;
+  ERL_NIF_TERM term;
+  /// Options the term was decoded with, their literal terms copied to env
+  decode_options options;
+  /// Estimated heap words of term, checked against max_term_words on a hit
+  size_t words;
+  /// Bytes charged to the cache for the entry
+  size_t memory;
+
+  ~cache_entry();
+};
+
+struct cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t entries;
+  size_t memory;
+  size_t max_memory;
+};
+
+struct result_cache;
+
+/// Creates the registry of caches. Returns 0 on success.
+int result_cache_start();
+/// Frees every cache. Entries still being copied by a caller are freed when
+/// the caller is done with them.
+void result_cache_stop();
+/// Returns the cache named by the atom `name`, created if need be, holding
+/// at most `max_memory` bytes. An existing cache is shrunk to the new limit.
+result_cache *result_cache_open(ERL_NIF_TERM name, size_t max_memory);
+/// Returns the cache named by the atom `name`, or nullptr.
+result_cache *result_cache_find(ERL_NIF_TERM name);
+/// Returns the entry for `input` decoded with `options`, made most recently
+/// used, or nullptr on a miss.
+std::shared_ptr<cache_entry> result_cache_lookup(result_cache *cache,
+                                                 uint64_t hash,
+                                                 const ErlNifBinary &input,
+                                                 const decode_options &options);
+/// Adds an entry, evicting the least recently used ones to make room. An
+/// entry larger than the whole cache is dropped.
+void result_cache_insert(result_cache *cache,
+                         std::shared_ptr<cache_entry> entry);
+cache_stats result_cache_stats(result_cache *cache);
+/// Hash of the bytes of a document, seeded with a hash of its options
+uint64_t content_hash(const unsigned char *data, size_t size, uint64_t seed);
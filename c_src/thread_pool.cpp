@@ -0,0 +1,97 @@
+#include "thread_pool.h"
+
+#include "erl_nif.h"
+
+#include <cstdint>
+#include <memory>
+
+/// Queue of tasks, protected by pool_mutex
+static ErlNifMutex *pool_mutex;
+static ErlNifCond *pool_cond;
+static pool_task *queue_head = nullptr;
+static pool_task *queue_tail = nullptr;
+static bool pool_stop = false;
+static std::unique_ptr<ErlNifTid[]> pool_tids;
+static size_t pool_size = 0;
+
+static void *worker_main(void *arg) {
+  size_t worker = (uintptr_t)arg;
+  enif_mutex_lock(pool_mutex);
+  for (;;) {
+    while (!queue_head && !pool_stop)
+      enif_cond_wait(pool_cond, pool_mutex);
+    if (!queue_head)
+      break;
+
+    pool_task *task = queue_head;
+    queue_head = task->next;
+    if (!queue_head)
+      queue_tail = nullptr;
+    enif_mutex_unlock(pool_mutex);
+
+    task->run(task, worker);
+    enif_mutex_lock(pool_mutex);
+  }
+  enif_mutex_unlock(pool_mutex);
+
+  return nullptr;
+}
+
+int thread_pool_start(size_t workers) {
+  pool_mutex = enif_mutex_create((char *)"esimdjson_pool_mutex");
+  pool_cond = enif_cond_create((char *)"esimdjson_pool_cond");
+  if (!pool_mutex || !pool_cond) {
+    if (pool_cond)
+      enif_cond_destroy(pool_cond);
+    if (pool_mutex)
+      enif_mutex_destroy(pool_mutex);
+    pool_mutex = nullptr;
+    pool_cond = nullptr;
+    return -1;
+  }
+
+  pool_stop = false;
+  pool_tids.reset(new ErlNifTid[workers]);
+  for (pool_size = 0; pool_size < workers; pool_size++) {
+    int error = enif_thread_create((char *)"esimdjson_pool",
+                                   &pool_tids[pool_size], worker_main,
+                                   (void *)(uintptr_t)pool_size, nullptr);
+    if (error) {
+      thread_pool_stop();
+      return error;
+    }
+  }
+
+  return 0;
+}
+
+void thread_pool_stop() {
+  enif_mutex_lock(pool_mutex);
+  pool_stop = true;
+  enif_cond_broadcast(pool_cond);
+  enif_mutex_unlock(pool_mutex);
+
+  // The workers drain the queue before they exit.
+  for (size_t i = 0; i < pool_size; i++)
+    enif_thread_join(pool_tids[i], nullptr);
+  pool_tids.reset();
+  pool_size = 0;
+  enif_cond_destroy(pool_cond);
+  enif_mutex_destroy(pool_mutex);
+  pool_mutex = nullptr;
+  pool_cond = nullptr;
+}
+
+size_t thread_pool_workers() { return pool_size; }
+
+void thread_pool_submit(pool_task *task) {
+  task->next = nullptr;
+  enif_mutex_lock(pool_mutex);
+  if (queue_tail)
+    queue_tail->next = task;
+  else
+    queue_head = task;
+  queue_tail = task;
+  enif_cond_signal(pool_cond);
+  enif_mutex_unlock(pool_mutex);
+}
@@ -0,0 +1,18 @@
+#include <cstddef>
+
+/// A unit of work for the thread pool. Tasks are embedded in the state of
+/// their caller, which is responsible for freeing them once they have run.
+struct pool_task {
+  /// Called on a worker thread, with the index of that worker
+  void (*run)(pool_task *task, size_t worker);
+  pool_task *next = nullptr;
+};
+
+/// Starts `workers` threads. Returns 0 on success.
+int thread_pool_start(size_t workers);
+/// Runs the tasks still queued, then stops and joins the threads.
+void thread_pool_stop();
+/// Number of worker threads, 0 when the pool is not running
+size_t thread_pool_workers();
+/// Queues a task to run on the next idle worker, in submission order.
+void thread_pool_submit(pool_task *task);
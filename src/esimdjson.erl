@@ -1,13 +1,39 @@
 -module(esimdjson).
--export([new/0, new/1, load/2, parse/2, max_capacity/1]).
+-export([new/0, new/1, load/2, load/3, parse/2, parse/3, parse_batch/2,
+         parse_parallel/2, parse_async/2, load_batch/2,
+         estimate/2, decode_profile/1,
+         max_capacity/1, trim/1, memory/0, memory/1,
+         pending_frees/0,
+         stats/0, stats/1, new_cache/2, cache_stats/1,
+         publish/2, publish/3, lookup/2, lookup/3, unpublish/1,
+         document_stats/1,
+         histograms/0, implementations/0, active_implementation/0]).
 -on_load(init/0).
 
 -define(APPNAME, esimdjson).
 -define(LIBNAME, esimdjson).
 
--type esimdjson_option() :: {max_capacity, integer()} | {fixed_capacity, integer()}.
+-type esimdjson_implementation() :: haswell | westmere | arm64 | ppc64 | fallback | atom().
+-type esimdjson_option() :: {max_capacity, integer()}
+                          | {fixed_capacity, integer()}
+                          | {max_depth, pos_integer()}
+                          | {shrink_after, pos_integer()}
+                          | {implementation, esimdjson_implementation()}
+                          | {owner, pid()}
+                          | esimdjson_decode_option().
 -type esimdjson_options() :: [esimdjson_option()].
 -type esimdjson_parser() :: any().
+-type esimdjson_decode_option() :: {big_integers, boolean()}
+                                 | {floats, float | decimal | binary}
+                                 | {objects, map | proplist | tuple_list}
+                                 | {duplicate_keys, first | last | error}
+                                 | {null_term, term()}
+                                 | {true_term, term()}
+                                 | {false_term, term()}
+                                 | {deadline_ms, pos_integer()}
+                                 | {max_term_words, pos_integer()}
+                                 | {cache, atom()}.
+-type esimdjson_decode_profile() :: any().
 -type esimdjson_error_reason() :: capacity
                                 | memalloc
                                 | depth_error
@@ -29,8 +55,33 @@
                                 | invalid_json_pointer
                                 | invalid_uri_fragment
                                 | unexpected_error
-                                | parser_in_use.
+                                | parser_in_use
+                                | owner_down
+                                | duplicate_key
+                                | deadline
+                                | caller_down
+                                | term_too_large.
 -type esimdjson_error() :: {error, {esimdjson_error_reason(), string()}}.
+-type esimdjson_stats() :: #{documents := non_neg_integer(),
+                             bytes := non_neg_integer(),
+                             errors := #{esimdjson_error_reason() => pos_integer()},
+                             peak_capacity := non_neg_integer(),
+                             parse_ns := non_neg_integer(),
+                             convert_ns := non_neg_integer()}.
+-type esimdjson_cache_stats() :: #{hits := non_neg_integer(),
+                                   misses := non_neg_integer(),
+                                   evictions := non_neg_integer(),
+                                   entries := non_neg_integer(),
+                                   memory := non_neg_integer(),
+                                   max_memory := non_neg_integer()}.
+-type esimdjson_document_stats() :: #{size := non_neg_integer(),
+                                      memory := non_neg_integer(),
+                                      index_memory := non_neg_integer(),
+                                      max_index_memory := non_neg_integer(),
+                                      indexed_objects := non_neg_integer()}.
+-type esimdjson_size_class() :: tiny | small | medium | large.
+-type esimdjson_histogram() :: #{esimdjson_size_class() =>
+                                     [{pos_integer() | infinity, pos_integer()}]}.
 
 -spec new() -> {ok, any()} | esimdjson_error().
 new() ->
@@ -50,10 +101,137 @@ load(_, _) ->
 parse(_, _) ->
     not_loaded(?LINE).
 
+-spec parse_batch(Parser :: esimdjson_parser(),
+                  Binaries :: [binary()]) -> [{ok, term()} | esimdjson_error()].
+parse_batch(_, _) ->
+    not_loaded(?LINE).
+
+-spec parse_parallel(Binaries :: [binary()],
+                     Opts :: [esimdjson_decode_option()]) ->
+          [{ok, term()} | esimdjson_error()].
+parse_parallel(_, _) ->
+    not_loaded(?LINE).
+
+-spec load_batch(Paths :: [string()],
+                 Opts :: [esimdjson_decode_option()]) ->
+          [{ok, term()} | esimdjson_error()].
+load_batch(_, _) ->
+    not_loaded(?LINE).
+
+-spec parse_async(Parser :: esimdjson_parser(),
+                  Binary :: binary()) -> {ok, reference()} | esimdjson_error().
+parse_async(_, _) ->
+    not_loaded(?LINE).
+
+-spec load(Parser :: esimdjson_parser(),
+           Path :: string(),
+           Profile :: esimdjson_decode_profile()) -> {ok, term()} | esimdjson_error().
+load(_, _, _) ->
+    not_loaded(?LINE).
+
+-spec parse(Parser :: esimdjson_parser(),
+            Binary :: binary(),
+            Profile :: esimdjson_decode_profile()) -> {ok, term()} | esimdjson_error().
+parse(_, _, _) ->
+    not_loaded(?LINE).
+
+-spec estimate(Parser :: esimdjson_parser(),
+               Binary :: binary()) -> {ok, non_neg_integer()} | esimdjson_error().
+estimate(_, _) ->
+    not_loaded(?LINE).
+
+-spec decode_profile(Opts :: [esimdjson_decode_option()]) ->
+          {ok, esimdjson_decode_profile()}.
+decode_profile(_) ->
+    not_loaded(?LINE).
+
 -spec max_capacity(Parser :: esimdjson_parser()) -> {ok, integer()}.
 max_capacity(_) ->
     not_loaded(?LINE).
 
+-spec trim(Parser :: esimdjson_parser()) -> {ok, integer()} | esimdjson_error().
+trim(_) ->
+    not_loaded(?LINE).
+
+-spec memory() -> {ok, non_neg_integer()}.
+memory() ->
+    not_loaded(?LINE).
+
+-spec memory(Parser :: esimdjson_parser()) ->
+          {ok, #{total | tape | string_buf | structural_indexes | depth_stacks | load_buf
+                 => non_neg_integer()}}.
+memory(_) ->
+    not_loaded(?LINE).
+
+-spec pending_frees() -> {ok, non_neg_integer()}.
+pending_frees() ->
+    not_loaded(?LINE).
+
+-spec stats() -> {ok, esimdjson_stats()}.
+stats() ->
+    not_loaded(?LINE).
+
+-spec stats(Parser :: esimdjson_parser()) -> {ok, esimdjson_stats()}.
+stats(_) ->
+    not_loaded(?LINE).
+
+-spec new_cache(Name :: atom(),
+                Opts :: [{max_memory, non_neg_integer()}]) -> ok | esimdjson_error().
+new_cache(_, _) ->
+    not_loaded(?LINE).
+
+-spec cache_stats(Name :: atom()) ->
+          {ok, esimdjson_cache_stats()} | {error, not_found}.
+cache_stats(_) ->
+    not_loaded(?LINE).
+
+-spec publish(Name :: atom(), Binary :: binary()) -> ok | esimdjson_error().
+publish(_, _) ->
+    not_loaded(?LINE).
+
+-spec publish(Name :: atom(),
+              Binary :: binary(),
+              Opts :: [{index_after, non_neg_integer()}
+                       | {max_index_memory, non_neg_integer()}]) ->
+          ok | esimdjson_error().
+publish(_, _, _) ->
+    not_loaded(?LINE).
+
+-spec lookup(Name :: atom(), Pointer :: binary()) ->
+          {ok, term()} | {error, not_found} | esimdjson_error().
+lookup(_, _) ->
+    not_loaded(?LINE).
+
+-spec lookup(Name :: atom(),
+             Pointer :: binary(),
+             Profile :: esimdjson_decode_profile()) ->
+          {ok, term()} | {error, not_found} | esimdjson_error().
+lookup(_, _, _) ->
+    not_loaded(?LINE).
+
+-spec unpublish(Name :: atom()) -> ok | {error, not_found}.
+unpublish(_) ->
+    not_loaded(?LINE).
+
+-spec document_stats(Name :: atom()) ->
+          {ok, esimdjson_document_stats()} | {error, not_found}.
+document_stats(_) ->
+    not_loaded(?LINE).
+
+-spec histograms() -> {ok, #{parse | load | convert => esimdjson_histogram()}}.
+histograms() ->
+    not_loaded(?LINE).
+
+-spec implementations() -> {ok, [#{name := esimdjson_implementation(),
+                                   description := string(),
+                                   supported := boolean()}]}.
+implementations() ->
+    not_loaded(?LINE).
+
+-spec active_implementation() -> {ok, esimdjson_implementation()}.
+active_implementation() ->
+    not_loaded(?LINE).
+
 init() ->
     SoName = case code:priv_dir(?APPNAME) of
         {error, bad_name} ->
@@ -66,7 +244,10 @@ init() ->
         Dir ->
             filename:join(Dir, ?LIBNAME)
     end,
-    erlang:load_nif(SoName, 0).
+    LoadInfo = [{Key, Value} || Key <- [implementation, async_free_threshold,
+                                        pool_workers],
+                                {ok, Value} <- [application:get_env(?APPNAME, Key)]],
+    erlang:load_nif(SoName, LoadInfo).
 
 not_loaded(Line) ->
     erlang:nif_error({not_loaded, [{module, ?MODULE}, {line, Line}]}).